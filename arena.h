@@ -0,0 +1,80 @@
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Bump allocator handing out memory from blocks of geometrically increasing
+ * size, which are all released at once by arena_fini(). */
+
+struct arena_blk {
+	struct arena_blk *prev;
+	size_t sz;	/* in chars, excluding this header */
+};
+
+struct arena {
+	struct arena_blk *blk;
+	char   *cur;
+	size_t  left;  /* in chars, in blk after cur */
+	size_t  sz;    /* in chars, total of all blocks */
+};
+
+#define ARENA_INIT		{ NULL, NULL, 0, 0, }
+#define ARENA_MIN_BLK		((size_t)1 << 16)
+#define ARENA_MAX_BLK		((size_t)1 << 26)
+
+/* align must be a power of 2 not larger than alignof(max_align_t) */
+static inline void * arena_alloc(struct arena *a, size_t sz, size_t align)
+{
+	size_t pad = -(uintptr_t)a->cur & (align - 1);
+	if (unlikely(sz + pad > a->left)) {
+		size_t bsz = a->blk ? MIN(2 * a->blk->sz, ARENA_MAX_BLK)
+		                    : ARENA_MIN_BLK;
+		struct arena_blk *b;
+		bsz = MAX(bsz, sz);
+		b = ck_malloc(sizeof(*b) + bsz);
+		b->prev = a->blk;
+		b->sz = bsz;
+		a->blk = b;
+		a->cur = (char *)(b + 1);
+		a->left = bsz;
+		a->sz += bsz;
+		pad = 0;
+	}
+	void *p = a->cur + pad;
+	a->cur += pad + sz;
+	a->left -= pad + sz;
+	return p;
+}
+
+/* hands all blocks of b over to a, which continues allocating from b's
+ * current one; b is left empty */
+static inline void arena_merge(struct arena *a, struct arena *b)
+{
+	struct arena_blk *first = b->blk;
+	if (!first)
+		return;
+	while (first->prev)
+		first = first->prev;
+	first->prev = a->blk;
+	a->blk = b->blk;
+	a->cur = b->cur;
+	a->left = b->left;
+	a->sz += b->sz;
+	*b = (struct arena)ARENA_INIT;
+}
+
+static inline void arena_fini(struct arena *a)
+{
+	struct arena_blk *b, *prev;
+	for (b = a->blk; b; b = prev) {
+		prev = b->prev;
+		free(b);
+	}
+	*a = (struct arena)ARENA_INIT;
+}
+
+#endif
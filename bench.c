@@ -0,0 +1,363 @@
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "array.h"
+#include "arena.h"
+#include "tnode.h"
+#include "pool.h"
+#include "split.h"
+
+#define USAGE	"usage: %s [-OPTS] [EXPR [...]]\n"
+
+#define HELP	"\
+Generates inputs A, B, ... deterministically and prints a line of timings\n\
+per phase and EXPR, tab-separated with a header line. The phases are:\n\
+  load    split the lines of the inputs into records, from memory\n\
+  sort    sort the inputs wrt. the fields of their first operand in EXPR\n\
+  eval    evaluate EXPR on the sorted inputs\n\
+  output  format the result as setop(1) does and write it to /dev/null\n\
+Load, sort and eval are measured on the lines of the inputs EXPR refers to,\n\
+output on the result.\n\
+Without EXPR a default matrix of expressions is run.\n\
+\n\
+Options [default]:\n\
+  -f N          fields per line [" XSTR(BENCH_DEF_FIELDS) "]\n\
+  -h            display this help message\n\
+  -j N          load, sort and evaluate in N threads [1]\n\
+  -k N          draw the keys of each input from N distinct ones [lines]\n\
+  -m N          number of inputs [" XSTR(BENCH_DEF_INPUTS) "]\n\
+  -n N          lines per input [" XSTR(BENCH_DEF_LINES) "]\n\
+  -o PCT        percentage of keys shared by consecutive inputs [" XSTR(BENCH_DEF_OVERLAP) "]\n\
+  -p            generate the lines in order of their keys [random order]\n\
+  -r N          repeat each measurement N times and report the fastest [" XSTR(BENCH_DEF_REPEAT) "]\n\
+  -s SEED       seed of the generator [" XSTR(BENCH_DEF_SEED) "]\n\
+  -w PREFIX     only write the inputs to the files PREFIX.A, PREFIX.B, ...\n\
+"
+
+#define BENCH_DEF_FIELDS	3
+#define BENCH_DEF_INPUTS	3
+#define BENCH_DEF_LINES		1000000
+#define BENCH_DEF_OVERLAP	50
+#define BENCH_DEF_REPEAT	3
+#define BENCH_DEF_SEED		1
+
+static const char *const bench_exprs[] = {
+	"A",
+	"A0 | B0",
+	"A0 & B0",
+	"A0 - B0",
+	"A0 ^ B0 ^ C0",
+	"(A0 | B0) - C0",
+	"A & B",
+	"A1 & B1",
+};
+
+enum { PH_LOAD, PH_SORT, PH_EVAL, PH_OUTPUT, PH_N };
+
+static const char *const phase_names[PH_N] = { "load", "sort", "eval", "output" };
+
+struct gen_opts {
+	unsigned long long lines, keys, seed;
+	unsigned fields, inputs, overlap;
+	int sorted;
+};
+
+/* splitmix64 */
+static uint64_t rnd_next(uint64_t *s)
+{
+	uint64_t x = (*s += 0x9e3779b97f4a7c15ULL);
+	x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ x >> 27) * 0x94d049bb133111ebULL;
+	return x ^ x >> 31;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Generates the lines of input i: keys are drawn from a window of g->keys
+ * ones, which is shifted between consecutive inputs such that they share
+ * g->overlap percent of it. Keys are zero-padded, so their order as numbers
+ * is that of setop. */
+static void gen_input(const struct gen_opts *g, unsigned i, struct array *a)
+{
+	uint64_t s = g->seed * 0x100000001b3ULL + i;
+	uint64_t shift = g->keys - g->keys * g->overlap / 100;
+	uint64_t *k = ck_malloc(g->lines * sizeof(*k));
+	for (size_t j=0; j<g->lines; j++)
+		k[j] = shift * i + rnd_next(&s) % g->keys;
+	if (g->sorted)
+		qsort(k, g->lines, sizeof(*k), u64_cmp);
+	for (size_t j=0; j<g->lines; j++) {
+		array_appendf(a, "k%012llu", (unsigned long long)k[j]);
+		for (unsigned f=1; f<g->fields; f++)
+			array_appendf(a, " v%u", (unsigned)(rnd_next(&s) % 1000));
+		array_appendf(a, "\n");
+	}
+	free(k);
+}
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static long maxrss_kb(void)
+{
+	struct rusage u;
+	return getrusage(RUSAGE_SELF, &u) ? -1 : u.ru_maxrss;
+}
+
+/* fields of the first operand on each input in e, 0 if it is not used */
+static void tnode_leaf_fields(const struct tnode *e, fieldmap_t *f)
+{
+	if (e->type == TNODE_ID && !f[e->id])
+		f[e->id] = e->fields;
+	for (unsigned i=0; i<e->n; i++)
+		tnode_leaf_fields(e->ch[i], f);
+}
+
+/* formats the fields of s like setop's writer and returns the number of
+ * chars written */
+static size_t put_str(FILE *o, const struct str *s, fieldmap_t fields)
+{
+	size_t n = 0;
+	int first = 1;
+	for (unsigned i=0; i<s->n && i<=MAX_FIELD; i++) {
+		if (!(fields & (fieldmap_t)1 << i))
+			continue;
+		struct field g = str_field(s, i);
+		if (!first)
+			n += fwrite(",", 1, 1, o);
+		n += fwrite(s->s + g.from, 1, g.len, o);
+		first = 0;
+	}
+	return n + fwrite("\n", 1, 1, o);
+}
+
+struct bench {
+	const struct array *text;
+	unsigned ninputs;
+	size_t lines;		/* per input */
+	struct pool *pool;
+	FILE *out;
+};
+
+/* lines and chars processed by a phase */
+struct volume {
+	size_t lines, bytes;
+};
+
+/* runs one measurement of expr, storing the seconds of each phase in t and
+ * the volume processed in v; only the inputs expr refers to are loaded.
+ * Returns 0 if expr cannot be parsed. */
+static int bench_run(
+	const struct bench *b, const char *expr, double t[PH_N],
+	struct volume v[PH_N]
+) {
+	struct iopts o = { BLANK, 1, 0, MAX_FIELD+1 };
+	struct src_array in = VARR_INIT;
+	struct arena arena = ARENA_INIT;
+	fieldmap_t f[MAX_IDS] = { 0 };
+	char msg[TNODE_ERR_MAX];
+	struct str_array u, *a;
+	struct str *s;
+	struct tnode *e;
+	double t0;
+	unsigned i;
+
+	varr_ensure_sz(&in,b->ninputs,0);
+	in.valid = b->ninputs;
+	if (!(e = tnode_parse(expr, MIN_ID + b->ninputs - 1, &in, msg))) {
+		fprintf(stderr, "error: %s\nerror parsing '%s'\n", msg, expr);
+		varr_fini(&in);
+		return 0;
+	}
+	e = tnode_flatten(e);
+	tnode_leaf_fields(e, f);
+
+	memset(v, 0, PH_N * sizeof(*v));
+	t0 = now();
+	for (i=0; i<b->ninputs; i++) {
+		char *p = b->text[i].c;
+		in.v[i] = (struct str_array)VARR_INIT;
+		if (!f[i])
+			continue;
+		parse_lines(&o, p, p + b->text[i].valid, &arena, in.v + i, b->pool);
+		v[PH_LOAD].lines += b->lines;
+		v[PH_LOAD].bytes += b->text[i].valid;
+	}
+	t[PH_LOAD] = now() - t0;
+	v[PH_SORT] = v[PH_EVAL] = v[PH_LOAD];
+
+	t0 = now();
+	for (i=0; i<b->ninputs; i++)
+		if (f[i])
+			sort_uniq(in.v + i, f[i], b->pool);
+	t[PH_SORT] = now() - t0;
+
+	t0 = now();
+	e = tnode_optimize(e, in.v);
+	tnode_share(e);
+	tnode_eval_shared(e, in.v, b->pool, tnode_eval);
+	u = tnode_eval(e, in.v, b->pool);
+	t[PH_EVAL] = now() - t0;
+
+	t0 = now();
+	varr_forall(s,&u)
+		v[PH_OUTPUT].bytes += put_str(b->out, s, e->fields);
+	fflush(b->out);
+	t[PH_OUTPUT] = now() - t0;
+	v[PH_OUTPUT].lines = u.valid;
+
+	varr_fini(&u);
+	varr_forall(a,&in) {
+		if (a - in.v >= b->ninputs)
+			varr_forall(s,a) {
+				free(s->s);
+				free(s->f);
+			}
+		varr_fini(a);
+	}
+	varr_fini(&in);
+	arena_fini(&arena);
+	tnode_tree_free(e);
+	return 1;
+}
+
+static void bench_report(
+	const struct bench *b, const char *expr, unsigned repeat
+) {
+	double best[PH_N], t[PH_N];
+	struct volume v[PH_N];
+	unsigned i, r;
+	for (r=0; r<repeat; r++) {
+		if (!bench_run(b, expr, t, v))
+			return;
+		for (i=0; i<PH_N; i++)
+			best[i] = r ? MIN(best[i], t[i]) : t[i];
+	}
+	for (i=0; i<PH_N; i++) {
+		double sec = MAX(best[i], 1e-9);
+		printf("%s\t%s\t%.6f\t%zu\t%zu\t%.0f\t%.2f\t%ld\n",
+		       expr, phase_names[i], best[i], v[i].lines, v[i].bytes,
+		       v[i].lines / sec, v[i].bytes / sec / (1 << 20),
+		       maxrss_kb());
+	}
+	fflush(stdout);
+}
+
+/* whether expr only refers to the first n inputs */
+static int uses_inputs(const char *expr, unsigned n)
+{
+	for (; *expr; expr++)
+		if (*expr >= MIN_ID + (int)n && *expr <= MAX_ID)
+			return 0;
+	return 1;
+}
+
+static unsigned long long parse_num(const char *s, char opt)
+{
+	char *endptr;
+	unsigned long long v;
+	errno = 0;
+	v = strtoull(s, &endptr, 10);
+	if (errno || endptr == s || *endptr)
+		DIE(1,"error: invalid number '%s' for option '-%c'\n",s,opt);
+	return v;
+}
+
+static void write_inputs(const char *prefix, const struct array *text, unsigned n)
+{
+	struct array path = ARRAY_INIT;
+	for (unsigned i=0; i<n; i++) {
+		FILE *f;
+		path.valid = 0;
+		array_printf(&path, 0, "%s.%c", prefix, MIN_ID + i);
+		if (!(f = fopen(path.c, "w")))
+			DIE(1,"error opening '%s': %s\n",path.c,strerror(errno));
+		if (fwrite(text[i].c, 1, text[i].valid, f) != text[i].valid ||
+		    fclose(f))
+			DIE(1,"error writing '%s': %s\n",path.c,strerror(errno));
+	}
+	array_fini(&path);
+}
+
+int main(int argc, char **argv)
+{
+	struct gen_opts g = {
+		BENCH_DEF_LINES, 0, BENCH_DEF_SEED,
+		BENCH_DEF_FIELDS, BENCH_DEF_INPUTS, BENCH_DEF_OVERLAP, 0,
+	};
+	unsigned nthreads = 1, repeat = BENCH_DEF_REPEAT, i;
+	char *prefix = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, ":f:hj:k:m:n:o:pr:s:w:")) != -1)
+		switch (opt) {
+		case 'f': g.fields = parse_num(optarg, opt); break;
+		case 'h': DIE(0,USAGE "\n" HELP,argv[0]);
+		case 'j': nthreads = parse_num(optarg, opt); break;
+		case 'k': g.keys = parse_num(optarg, opt); break;
+		case 'm': g.inputs = parse_num(optarg, opt); break;
+		case 'n': g.lines = parse_num(optarg, opt); break;
+		case 'o': g.overlap = parse_num(optarg, opt); break;
+		case 'p': g.sorted = 1; break;
+		case 'r': repeat = parse_num(optarg, opt); break;
+		case 's': g.seed = parse_num(optarg, opt); break;
+		case 'w': prefix = optarg; break;
+		case '?': DIE(1,"error: unknown option '-%c'\n",optopt);
+		case ':': DIE(1,"error: option '-%c' requires an argument\n",optopt);
+		}
+	if (!g.keys)
+		g.keys = MAX(g.lines, 1);
+	if (!g.fields || g.fields > MAX_FIELD+1)
+		DIE(1,"error: number of fields must be between 1 and %d\n",MAX_FIELD+1);
+	if (!g.inputs || g.inputs > MAX_IDS)
+		DIE(1,"error: number of inputs must be between 1 and %d\n",MAX_IDS);
+	if (g.overlap > 100)
+		DIE(1,"error: overlap must be between 0 and 100\n");
+	if (!nthreads || !repeat)
+		DIE(1,"error: number of threads and repetitions must be positive\n");
+
+	struct array *text = ck_calloc(g.inputs, sizeof(*text));
+	struct bench b = { text, g.inputs, g.lines, NULL, NULL };
+	for (i=0; i<g.inputs; i++) {
+		text[i] = (struct array)ARRAY_INIT;
+		gen_input(&g, i, text + i);
+	}
+	if (prefix) {
+		write_inputs(prefix, text, g.inputs);
+	} else {
+		if (!(b.out = fopen("/dev/null", "w")))
+			DIE(1,"error opening '/dev/null': %s\n",strerror(errno));
+		b.pool = nthreads > 1 ? pool_create(nthreads) : NULL;
+		printf("# lines=%llu fields=%u keys=%llu inputs=%u overlap=%u "
+		       "sorted=%d seed=%llu threads=%u repeat=%u\n",
+		       g.lines, g.fields, g.keys, g.inputs, g.overlap,
+		       g.sorted, g.seed, nthreads, repeat);
+		printf("expr\tphase\tseconds\tlines\tbytes\tlines_per_s\tmb_per_s\tmaxrss_kb\n");
+		if (optind < argc)
+			for (; optind < argc; optind++)
+				bench_report(&b, argv[optind], repeat);
+		else
+			for (i=0; i<ARRAY_SIZE(bench_exprs); i++)
+				if (uses_inputs(bench_exprs[i], g.inputs))
+					bench_report(&b, bench_exprs[i], repeat);
+		if (b.pool)
+			pool_free(b.pool);
+		fclose(b.out);
+	}
+	for (i=0; i<g.inputs; i++)
+		array_fini(text + i);
+	free(text);
+	return 0;
+}
@@ -0,0 +1,46 @@
+
+#include <math.h>
+
+#include "common.h"
+#include "hll.h"
+
+/* str_hash() mixes its last word only weakly into the high bits, which pick
+ * the register, so the bits are spread once more (splitmix64's finalizer) */
+static uint64_t hll_mix(uint64_t x)
+{
+	x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ x >> 27) * 0x94d049bb133111ebULL;
+	return x ^ x >> 31;
+}
+
+void hll_add(struct hll *h, uint64_t x)
+{
+	x = hll_mix(x);
+	unsigned i = x >> (64 - HLL_P);
+	unsigned long long w = x & ~(~0ULL << (64 - HLL_P));
+	unsigned char rho = w ? 64 - HLL_P - LOG2(w) : 64 - HLL_P + 1;
+	if (rho > h->r[i])
+		h->r[i] = rho;
+}
+
+void hll_merge(struct hll *h, const struct hll *g)
+{
+	for (unsigned i=0; i<HLL_M; i++)
+		h->r[i] = MAX(h->r[i], g->r[i]);
+}
+
+/* the raw estimate is biased for small sets, for which linear counting on the
+ * number of empty registers is used instead */
+double hll_estimate(const struct hll *h)
+{
+	double m = HLL_M, z = 0;
+	unsigned zeros = 0;
+	for (unsigned i=0; i<HLL_M; i++) {
+		z += ldexp(1, -h->r[i]);
+		zeros += !h->r[i];
+	}
+	double e = 0.7213 / (1 + 1.079 / m) * m * m / z;
+	if (e <= 2.5 * m && zeros)
+		e = m * log(m / zeros);
+	return e;
+}
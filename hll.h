@@ -0,0 +1,31 @@
+
+#ifndef HLL_H
+#define HLL_H
+
+#include <stdint.h>
+
+/* HyperLogLog sketch estimating the number of distinct 64-bit hashes added to
+ * it in constant memory: the first HLL_P bits of each hash select one of
+ * HLL_M registers keeping the maximum position of the first set bit among
+ * the remaining ones. */
+
+#define HLL_P		12
+#define HLL_M		(1u << HLL_P)
+
+/* relative standard error of hll_estimate(), 1.04 / sqrt(HLL_M) */
+#define HLL_REL_ERR	(1.04 / 64)
+
+struct hll {
+	unsigned char r[HLL_M];
+};
+
+#define HLL_INIT	{ { 0 } }
+
+void hll_add(struct hll *h, uint64_t x);
+
+/* makes h the sketch of the union of the sets h and g were built from */
+void hll_merge(struct hll *h, const struct hll *g);
+
+double hll_estimate(const struct hll *h);
+
+#endif
@@ -0,0 +1,171 @@
+
+#include <limits.h>
+
+#include "libsetop.h"
+#include "tnode.h"
+#include "split.h"
+
+/* The inputs are kept in the order they are added, which decides the
+ * entries representing equal keys as in setop(1). Evaluations work on
+ * shallow copies of the inputs, to which their literal sets are appended. */
+
+struct setop {
+	struct src_array in;
+	struct arena arena;	/* field tables of the inputs */
+	struct pool *pool;
+};
+
+struct setop_result {
+	struct str_array u;
+	struct src_array sets;	/* literal sets are owned from ninputs on */
+	size_t ninputs;
+	fieldmap_t fields;
+};
+
+struct setop * setop_create(unsigned nthreads)
+{
+	struct setop *x = ck_calloc(1, sizeof(*x));
+	x->in = (struct src_array)VARR_INIT;
+	x->arena = (struct arena)ARENA_INIT;
+	x->pool = nthreads > 1 ? pool_create(nthreads) : NULL;
+	return x;
+}
+
+void setop_free(struct setop *x)
+{
+	struct str_array *t;
+	varr_forall(t,&x->in)
+		varr_fini(t);
+	varr_fini(&x->in);
+	arena_fini(&x->arena);
+	if (x->pool)
+		pool_free(x->pool);
+	free(x);
+}
+
+static int setop_add(struct setop *x, struct str_array *a)
+{
+	if (x->in.valid == MAX_IDS) {
+		varr_fini(a);
+		return -1;
+	}
+	varr_append(&x->in,a,1,1);
+	return MIN_ID + x->in.valid - 1;
+}
+
+int setop_add_records(struct setop *x, const struct setop_record *v, size_t n)
+{
+	struct str_array a = VARR_INIT;
+	varr_ensure_sz(&a,n,0);
+	for (size_t i=0; i<n; i++) {
+		const struct setop_record *e = v + i;
+		size_t ext = 0;
+		for (unsigned j=0; j<e->n; j++) {
+			if (e->f[j].len > UINT_MAX || e->f[j].from > UINT_MAX - e->f[j].len) {
+				varr_fini(&a);
+				return -1;
+			}
+			ext = MAX(ext, e->f[j].from + e->f[j].len);
+		}
+		struct str s = { (char *)e->s, NULL, e->n, ext <= STR_NARROW_MAX };
+		s.f = arena_alloc(&x->arena, str_fsz(&s), alignof(struct field));
+		for (unsigned j=0; j<e->n; j++) {
+			struct field g = { e->f[j].from, e->f[j].len };
+			if (s.narrow)
+				((struct field16 *)s.f)[j] = (struct field16){ g.from, g.len };
+			else
+				((struct field *)s.f)[j] = g;
+		}
+		a.v[i] = s;
+	}
+	a.valid = n;
+	return setop_add(x, &a);
+}
+
+int setop_add_text(
+	struct setop *x, const char *buf, size_t len, const char *isep,
+	unsigned flags
+) {
+	struct iopts o = {
+		(char *)(isep ? isep : BLANK),
+		!(flags & SETOP_NO_TRIM),
+		!!(flags & SETOP_ALLOW_EMPTY),
+		MAX_FIELD+1,
+	};
+	struct str_array a = VARR_INIT;
+	char *p = (char *)buf;
+	if (x->in.valid == MAX_IDS)
+		return -1;
+	parse_lines(&o, p, p + len, &x->arena, &a, x->pool);
+	return setop_add(x, &a);
+}
+
+struct setop_result * setop_eval(
+	const struct setop *x, const char *expr, char *err, size_t errsz
+) {
+	struct setop_result *r = ck_calloc(1, sizeof(*r));
+	char msg[TNODE_ERR_MAX];
+	struct tnode *e;
+
+	r->sets = (struct src_array)VARR_INIT;
+	r->ninputs = x->in.valid;
+	varr_ensure_sz(&r->sets,x->in.valid,0);
+	if (x->in.valid)
+		memcpy(r->sets.v, x->in.v, x->in.valid * sizeof(*x->in.v));
+	r->sets.valid = x->in.valid;
+
+	if (!(e = tnode_parse(expr, MIN_ID + x->in.valid - 1, &r->sets, msg))) {
+		if (err && errsz)
+			snprintf(err, errsz, "%s", msg);
+		r->u = (struct str_array)VARR_INIT;
+		setop_result_free(r);
+		return NULL;
+	}
+	e = tnode_optimize(tnode_flatten(e), r->sets.v);
+	tnode_share(e);
+	tnode_eval_shared(e, r->sets.v, x->pool, tnode_eval);
+	r->u = tnode_eval(e, r->sets.v, x->pool);
+	r->fields = e->fields;
+	tnode_tree_free(e);
+	return r;
+}
+
+void setop_result_free(struct setop_result *r)
+{
+	struct str_array *t;
+	struct str *s;
+	for (t = r->sets.v + r->ninputs; t < r->sets.v + r->sets.valid; t++) {
+		varr_forall(s,t) {
+			free(s->s);
+			free(s->f);
+		}
+		varr_fini(t);
+	}
+	varr_fini(&r->sets);
+	varr_fini(&r->u);
+	free(r);
+}
+
+size_t setop_result_size(const struct setop_result *r)
+{
+	return r->u.valid;
+}
+
+unsigned setop_result_fields(const struct setop_result *r)
+{
+	return r->fields;
+}
+
+unsigned setop_result_nfields(const struct setop_result *r, size_t i)
+{
+	return r->u.v[i].n;
+}
+
+const char * setop_result_field(
+	const struct setop_result *r, size_t i, unsigned j, size_t *len
+) {
+	const struct str *s = r->u.v + i;
+	struct field g = str_field(s, j);
+	*len = g.len;
+	return s->s + g.from;
+}
@@ -0,0 +1,78 @@
+
+#ifndef LIBSETOP_H
+#define LIBSETOP_H
+
+#include <stddef.h>
+
+/* libsetop: set operations of setop(1) on records held in memory.
+ *
+ * Inputs are registered in the order A, B, ... and EXPR uses the syntax of
+ * setop(1), including literal sets. The records of inputs and results point
+ * into the memory registered, which has to stay valid and unchanged until
+ * the context is freed.
+ *
+ * A context created with nthreads <= 1 may be shared by concurrent calls of
+ * setop_eval() once all inputs are added; with more threads it may only be
+ * used by the thread that created it; if threads cannot be created, it
+ * evaluates on fewer. Errors are reported by return values, only failing
+ * memory allocations terminate the process. */
+
+struct setop;
+struct setop_result;
+
+/* chars [from,from+len) of a record */
+struct setop_field {
+	size_t from, len;
+};
+
+struct setop_record {
+	const char *s;
+	const struct setop_field *f;
+	unsigned n;
+};
+
+/* flags of setop_add_text(), see options '-t' and '-e' of setop(1) */
+#define SETOP_NO_TRIM		0x1
+#define SETOP_ALLOW_EMPTY	0x2
+
+/* creates a context evaluating on nthreads threads */
+struct setop * setop_create(unsigned nthreads);
+void setop_free(struct setop *x);
+
+/* Registers the n records v as the next input. Returns its id 'A', 'B', ...
+ * or -1 if there are too many inputs or a field is out of range. */
+int setop_add_records(struct setop *x, const struct setop_record *v, size_t n);
+
+/* Registers the newline-terminated lines of buf[0:len] as the next input,
+ * split into fields at the chars in isep or at blanks if isep is NULL.
+ * Returns its id or -1 if there are too many inputs. */
+int setop_add_text(
+	struct setop *x, const char *buf, size_t len, const char *isep,
+	unsigned flags
+);
+
+/* Evaluates expr on the inputs of x. Returns NULL and stores a message in
+ * err[0:errsz], if err is not NULL, if expr cannot be parsed, e.g. if it
+ * contains chars outside the syntax of setop(1). */
+struct setop_result * setop_eval(
+	const struct setop *x, const char *expr, char *err, size_t errsz
+);
+void setop_result_free(struct setop_result *r);
+
+/* number of records of r, which are ordered as setop(1) prints them */
+size_t setop_result_size(const struct setop_result *r);
+
+/* fields selected by the root of EXPR, bit j for field j; setop(1) prints
+ * only these */
+unsigned setop_result_fields(const struct setop_result *r);
+
+/* number of fields of record i of r */
+unsigned setop_result_nfields(const struct setop_result *r, size_t i);
+
+/* Field j of record i of r, its length is stored in *len. The chars are not
+ * terminated and point into the input the record comes from. */
+const char * setop_result_field(
+	const struct setop_result *r, size_t i, unsigned j, size_t *len
+);
+
+#endif
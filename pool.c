@@ -0,0 +1,156 @@
+
+#include <pthread.h>
+
+#include "pool.h"
+#include "array.h"
+
+VARR_DECL(task_deque,struct task *);
+
+struct worker {
+	struct pool *p;
+	pthread_t thread;
+	struct task_deque q;	/* owner takes from the back, thieves the front */
+	size_t front;
+};
+
+struct pool {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_key_t self;
+	struct worker *w;
+	unsigned n;
+	int stop;
+};
+
+static struct task * worker_take(struct worker *w)
+{
+	if (w->front == w->q.valid)
+		return NULL;
+	struct task *t = w->q.v[--w->q.valid];
+	if (w->front == w->q.valid)
+		w->front = w->q.valid = 0;
+	return t;
+}
+
+static struct task * worker_steal(struct worker *w)
+{
+	if (w->front == w->q.valid)
+		return NULL;
+	struct task *t = w->q.v[w->front++];
+	if (w->front == w->q.valid)
+		w->front = w->q.valid = 0;
+	return t;
+}
+
+/* to be called with p->mtx held */
+static struct task * pool_next(struct pool *p, struct worker *self)
+{
+	struct task *t = worker_take(self);
+	for (unsigned i=1; !t && i<p->n; i++)
+		t = worker_steal(p->w + (self - p->w + i) % p->n);
+	return t;
+}
+
+/* runs t with p->mtx released */
+static void pool_run(struct pool *p, struct task *t)
+{
+	pthread_mutex_unlock(&p->mtx);
+	t->run(t);
+	pthread_mutex_lock(&p->mtx);
+	t->done = 1;
+	pthread_cond_broadcast(&p->cond);
+}
+
+static struct worker * pool_self(struct pool *p)
+{
+	struct worker *w = pthread_getspecific(p->self);
+	return w ? w : p->w;
+}
+
+static void * worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *p = w->p;
+	struct task *t;
+
+	pthread_setspecific(p->self, w);
+	pthread_mutex_lock(&p->mtx);
+	while (!p->stop)
+		if ((t = pool_next(p, w)))
+			pool_run(p, t);
+		else
+			pthread_cond_wait(&p->cond, &p->mtx);
+	pthread_mutex_unlock(&p->mtx);
+	return NULL;
+}
+
+struct pool * pool_create(unsigned nthreads)
+{
+	struct pool *p = ck_calloc(1, sizeof(*p));
+	unsigned i;
+	p->n = MAX(nthreads, 1);
+	p->w = ck_calloc(p->n, sizeof(*p->w));
+	if (pthread_key_create(&p->self, NULL)) {
+		free(p->w);
+		free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->mtx, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	for (i=0; i<p->n; i++)
+		p->w[i].p = p;
+	pthread_setspecific(p->self, p->w);
+	/* the workers only look at p->n once they get the lock */
+	pthread_mutex_lock(&p->mtx);
+	for (i=1; i<p->n; i++)
+		if (pthread_create(&p->w[i].thread, NULL, worker_main, p->w + i))
+			break;
+	p->n = i;
+	pthread_mutex_unlock(&p->mtx);
+	return p;
+}
+
+void pool_free(struct pool *p)
+{
+	pthread_mutex_lock(&p->mtx);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mtx);
+	for (unsigned i=1; i<p->n; i++)
+		pthread_join(p->w[i].thread, NULL);
+	for (unsigned i=0; i<p->n; i++)
+		varr_fini(&p->w[i].q);
+	pthread_key_delete(p->self);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->mtx);
+	free(p->w);
+	free(p);
+}
+
+unsigned pool_nthreads(const struct pool *p)
+{
+	return p->n;
+}
+
+void pool_spawn(struct pool *p, struct task *t)
+{
+	struct worker *w = pool_self(p);
+	t->done = 0;
+	pthread_mutex_lock(&p->mtx);
+	varr_append(&w->q,&t,1,1);
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mtx);
+}
+
+void pool_join(struct pool *p, struct task *t)
+{
+	struct worker *w = pool_self(p);
+	struct task *u;
+	pthread_mutex_lock(&p->mtx);
+	while (!t->done)
+		if ((u = pool_next(p, w)))
+			pool_run(p, u);
+		else
+			pthread_cond_wait(&p->cond, &p->mtx);
+	pthread_mutex_unlock(&p->mtx);
+}
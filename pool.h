@@ -0,0 +1,33 @@
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "common.h"
+
+/* Fork-join thread pool: every thread owns a deque of spawned tasks, pops its
+ * own newest task first and steals the oldest ones of the others when idle.
+ * Threads waiting in pool_join() execute tasks meanwhile. */
+
+struct pool;
+
+struct task {
+	void (*run)(struct task *t);
+	int done;
+};
+
+/* Creates a pool of nthreads threads including the calling one, or of fewer
+ * if not all can be created. Returns NULL if the pool cannot be set up at
+ * all; callers then run the tasks on the calling thread alone, as without a
+ * pool. */
+struct pool * pool_create(unsigned nthreads);
+void pool_free(struct pool *p);
+
+unsigned pool_nthreads(const struct pool *p);
+
+/* queues t for execution by any thread of p */
+void pool_spawn(struct pool *p, struct task *t);
+
+/* returns after t, which must have been spawned on p, has run */
+void pool_join(struct pool *p, struct task *t);
+
+#endif
@@ -2,13 +2,24 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "array.h"
+#include "arena.h"
 #include "tnode.h"
+#include "stream.h"
+#include "pool.h"
+#include "hll.h"
+#include "sidx.h"
+#include "split.h"
 #include "tparse.h"
-#include "tlex.h"
-
-#define BLANK	" \f\t\r\n"
 
 #ifndef SETOP_DEF_ISEP
 # define SETOP_DEF_ISEP		BLANK
@@ -28,11 +39,42 @@
 
 #define HELP	"\
 Options [default]:\n\
+  -0            terminate output entries by NUL instead of newline\n\
+  -a FILE       with '-i': lines of FILE are added to the next input, they\n\
+                replace those with the same key\n\
+  -c            only print the number of entries of the result\n\
   -d ISEP       use ISEP as input field delimiter(s) [" SETOP_DEF_ISEP_DESC "]\n\
   -D OSEP       use OSEP as output field separator [" SETOP_DEF_OSEP_DESC "]\n\
   -e            don't dismiss empty lines [dismiss]\n\
+  -E            only print an estimate of the number of entries of the\n\
+                result and its standard error, in constant memory; all\n\
+                operands of EXPR need to have the same FIELDS\n\
   -h            display this help message\n\
+  -i PREV       incremental: PREV is the result of EXPR written by '-o'\n\
+                before the changes given by '-a' and '-r'; print the\n\
+                entries leaving and entering it prefixed by '-' and '+',\n\
+                and update it to the file of '-o', if given [off]\n\
+  -j N          load inputs and evaluate EXPR in N threads [1]\n\
+  -k            if all operands of EXPR have the same FIELDS, evaluate it on\n\
+                integer ids assigned to the distinct keys of all inputs [off]\n\
+  -M SIZE       sort in chunks taking at most SIZE bytes together (suffixes\n\
+                K, M, G, T), spilling to $TMPDIR, and stream the results\n\
+                [unlimited]\n\
+  -o FILE       write the result to FILE as index for the evaluation of\n\
+                further expressions, which recognize it as input [off]\n\
+  -r FILE       with '-i': lines of FILE are removed from the next input\n\
+  -s            inputs are sorted wrt. their FIELDS in EXPR: verify their\n\
+                order and stream the results without sorting them again\n\
+  -S SOCKET     serve: load the inputs and evaluate expressions received\n\
+                on the Unix domain socket SOCKET, one per connection and\n\
+                terminated by newline, instead of EXPR; the answer is a\n\
+                line 'ok' and the result, or 'error: ...'. Inputs are\n\
+                reloaded when their files change, keeping the previous\n\
+                version if that fails [off]\n\
   -t            disable trimming blanks left and right of key [enable]\n\
+  -u            evaluate EXPR by hashing, the output is unordered; if\n\
+                records lack some of the FIELDS of an operand, entries\n\
+                may be matched differently than without '-u' [sort]\n\
   -v            print parse tree of EXPR to stderr\n\
 \n\
 A, B, ... are paths to filenames; optionally any of these can be '-' for stdin.\n\
@@ -59,84 +101,129 @@ Literal sets are supported via the following syntax:\n\
 "
 //  { x, (y,z), '#' : (A(x) | B2(x)) & C(y) & {'abc','def'}(z) & !0 }\n
 
-struct iopts {
-	char *isep;
-	unsigned trim : 1;
-	unsigned allow_empty : 1;
+struct input {
+	char *fname;
+	struct iopts o;
+	struct arena arena;	/* holds the records' fields and strings */
+	char *map;	/* mmap()ed contents the records point into, if any */
+	size_t map_sz;
+	char *add, *del;	/* delta files for option '-i', if any */
 };
 
-static int entry_extract(
-	struct str *e, const char *line, size_t len, const struct iopts *o
-) {
-	VARR_DECL_ANON(struct field) f = VARR_INIT;
-	e->s = strndup(line, len);
-
-	unsigned field = 0;
-	unsigned i = 0;
-	while (i <= len) {
-		if (o->trim)
-			i += strspn(e->s + i, BLANK);
-		unsigned fld_len = strcspn(e->s + i, o->isep);
-		struct field g = { i, fld_len };
-		if (o->trim)
-			while (g.len && strchr(BLANK, e->s[i+g.len-1]))
-				g.len--;
-		varr_append(&f,&g,1,1);
-#if DEBUG
-		fprintf(stderr, "extracted field %d '%.*s'\n",
-			(int)f.valid-1, (int)g.len, e->s + g.from);
-#endif
-		i += fld_len;
-		unsigned sep_len = strchr(o->isep, e->s[i]) ? 1 : 0; // strspn(e->s + i, field_sep);
-		i += sep_len;
-		if (!sep_len)
-			break;
-	}
-	e->f = f.v;
-	e->n = f.valid;
+VARR_DECL(input_array,struct input);
+
+/* loads a regular file by mapping it, the records point into the mapping */
+static int read_mapped(
+	struct input *in, FILE *f, struct str_array *r, struct pool *pool
+) {
+	struct stat st;
+	char *p;
+
+	if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+	    (uintmax_t)st.st_size > SIZE_MAX)
+		return 0;
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (p == MAP_FAILED)
+		return 0;
+	posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+	in->map = p;
+	in->map_sz = st.st_size;
+	parse_lines(&in->o, p, p + in->map_sz, &in->arena, r, pool);
+	return 1;
+}
 
-	if (o->allow_empty || e->n)
+/* Reports if index x for desc was not built with the options o or, if its
+ * source still exists, has changed since; returns 1 then. */
+static int sidx_stale(const struct sidx *x, const struct iopts *o, char desc)
+{
+	uint32_t flags = (o->trim ? SIDX_TRIM : 0) |
+	                 (o->allow_empty ? SIDX_ALLOW_EMPTY : 0);
+	struct stat st;
+	if (strcmp(x->isep, o->isep) || x->h->flags != flags) {
+		fprintf(stderr, "error: index '%s' for %c was built with different "
+		        "options '-d', '-e' or '-t'\n", x->name, desc);
 		return 1;
-	free(e->s);
-	free(e->f);
+	}
+	if (*x->src && !stat(x->src, &st) &&
+	    ((uint64_t)st.st_size != x->h->src_size ||
+	     st.st_mtim.tv_sec != x->h->src_mtime_sec ||
+	     st.st_mtim.tv_nsec != x->h->src_mtime_nsec)) {
+		fprintf(stderr, "error: index '%s' for %c is out of date wrt. '%s'\n",
+		        x->name, desc, x->src);
+		return 1;
+	}
 	return 0;
 }
 
+static void sidx_check(const struct sidx *x, const struct iopts *o, char desc)
+{
+	if (sidx_stale(x, o, desc))
+		exit(1);
+}
+
+/* loads an index written by option '-o'; the records are used in place, only
+ * their headers are filled in */
+static int read_index(struct input *in, FILE *f, char desc, struct str_array *r)
+{
+	struct sidx x;
+	if (!sidx_map(&x, fileno(f), in->fname))
+		return 0;
+	sidx_check(&x, &in->o, desc);
+	in->map = x.map;
+	in->map_sz = x.sz;
+	varr_ensure_sz(r,x.h->nrec,0);
+	for (size_t i=0; i<x.h->nrec; i++)
+		r->v[i] = sidx_get(&x, i);
+	r->valid = x.h->nrec;
+	return 1;
+}
+
+/* stdin_data is only used for stdin and may be NULL otherwise */
 static void read_input(
-	char *fname, char desc, const struct iopts *o,
-	struct str_array *r, struct str_array **stdin_data
+	struct input *in, char desc, struct str_array *r,
+	struct str_array **stdin_data, struct pool *pool
 ) {
+	char *fname = in->fname;
+	const struct iopts *o = &in->o;
 	int is_stdin = !strcmp(fname, "-");
 	FILE *f;
 
 	*r = (struct str_array)VARR_INIT;
 	if (is_stdin && *stdin_data) {
-		struct str *s;
+		/* records stay owned by the input read first */
 		varr_append_a(r,*stdin_data,0);
-		varr_forall(s,r) {
-			s->s = strdup(s->s);
-			s->f = memdup(s->f, sizeof(*s->f) * s->n);
-		}
 		return;
 	}
 
 	if (!(f = is_stdin ? stdin : fopen(fname, "r")))
 		DIE(1,"error opening '%s' for %c: %s\n",fname,desc,strerror(errno));
 
+	if (!is_stdin && (read_index(in, f, desc, r) ||
+	                  read_mapped(in, f, r, pool))) {
+		fclose(f);
+		return;
+	}
+
 	/* read */
+	struct iclass c;
+	struct field_array fa = VARR_INIT;
 	int ret = 0;
 	char *line = NULL;
 	size_t sz = 0;
 	ssize_t len;
+	iclass_init(&c, o);
 	while (errno = 0, (len = getline(&line, &sz, f)) > 0) {
 		if (line[len-1] == '\n')
 			line[--len] = '\0';
 		struct str e;
-		if (entry_extract(&e, line, len, o))
+		if (entry_extract(&e, line, len, sz, o, &c, &fa)) {
+			e = entry_store(&in->arena, &e, len, 1);
 			varr_append(r,&e,1,1);
+		}
 	}
 	ret = -errno;
 	free(line);
+	varr_fini(&fa);
 	fclose(f);
 	if (ret)
 		DIE(1,"error reading '%s' for %c: %s\n",fname,desc,strerror(-ret));
@@ -145,28 +232,981 @@ static void read_input(
 		*stdin_data = r;
 }
 
-int yyparse(struct tnode **expr, yyscan_t scanner, char max_id, struct src_array *sets);
+struct read_task {
+	struct task t;
+	struct input *in;
+	char desc;
+	struct str_array *r;
+	struct pool *pool;
+};
+
+static void read_task_run(struct task *t)
+{
+	struct read_task *x = (struct read_task *)t;
+	read_input(x->in, x->desc, x->r, NULL, x->pool);
+}
+
+/* Reads in[i] into r[i]. With a pool, files are read concurrently while
+ * stdin is read by the calling thread. */
+static void read_inputs(
+	const struct input_array *in, struct str_array *r, struct pool *pool
+) {
+	struct read_task *x = ck_calloc(in->valid, sizeof(*x));
+	struct str_array *stdin_data = NULL;
+	size_t i;
+	for (i=0; i<in->valid; i++)
+		if (pool && in->v[i].o.nfields && strcmp(in->v[i].fname, "-")) {
+			x[i] = (struct read_task){
+				{ read_task_run, 0 }, in->v + i, MIN_ID + i,
+				r + i, pool,
+			};
+			pool_spawn(pool, &x[i].t);
+		}
+	for (i=0; i<in->valid; i++)
+		if (!x[i].in && in->v[i].o.nfields)
+			read_input(in->v + i, MIN_ID + i, r + i, &stdin_data, pool);
+	for (i=0; i<in->valid; i++)
+		if (x[i].in)
+			pool_join(pool, &x[i].t);
+	free(x);
+}
+
+struct file_stream {
+	struct stream base;
+	FILE *f;
+	const char *fname;
+	char desc;
+	const struct iopts *o;
+	struct iclass c;
+	struct field_array fa;
+	char *line;
+	size_t sz;
+	struct str cur;
+};
+
+static const struct str * file_stream_next(struct stream *t)
+{
+	struct file_stream *s = (struct file_stream *)t;
+	ssize_t len;
+
+	if (!s->f)
+		return NULL;
+	while (errno = 0, (len = getline(&s->line, &s->sz, s->f)) > 0) {
+		if (s->line[len-1] == '\n')
+			s->line[--len] = '\0';
+		if (entry_extract(&s->cur, s->line, len, s->sz, s->o, &s->c,
+		                  &s->fa))
+			return &s->cur;
+	}
+	if (errno)
+		DIE(1,"error reading '%s' for %c: %s\n",s->fname,s->desc,strerror(errno));
+	if (s->f != stdin)
+		fclose(s->f);
+	s->f = NULL;
+	return NULL;
+}
+
+static void file_stream_free(struct stream *t)
+{
+	struct file_stream *s = (struct file_stream *)t;
+	if (s->f && s->f != stdin)
+		fclose(s->f);
+	varr_fini(&s->fa);
+	free(s->line);
+	free(s);
+}
+
+static struct stream * file_stream_create(
+	FILE *f, const char *fname, char desc, const struct iopts *o
+) {
+	struct file_stream *s = ck_calloc(1, sizeof(*s));
+	s->base.next = file_stream_next;
+	s->base.free = file_stream_free;
+	s->f = f;
+	s->fname = fname;
+	s->desc = desc;
+	s->o = o;
+	iclass_init(&s->c, o);
+	return &s->base;
+}
+
+struct leaf_data {
+	const struct input_array *in;
+	const struct src_array *sets;
+	int sorted;
+};
+
+/* streams the unsorted records of input id, which is a literal set if it is
+ * not a file */
+static struct stream * input_stream(
+	const struct input_array *in, const struct src_array *sets, int id
+) {
+	if (id >= in->valid)
+		return stream_create_array(sets->v + id);
+	const struct input *i = in->v + id;
+	struct sidx x;
+	FILE *f;
+	if (!strcmp(i->fname, "-")) {
+		f = stdin;
+	} else if (!(f = fopen(i->fname, "r"))) {
+		DIE(1,"error opening '%s' for %c: %s\n",i->fname,MIN_ID+id,
+		    strerror(errno));
+	} else if (sidx_map(&x, fileno(f), i->fname)) {
+		sidx_check(&x, &i->o, MIN_ID+id);
+		fclose(f);
+		return stream_create_sidx(&x);
+	}
+	return file_stream_create(f, i->fname, MIN_ID+id, &i->o);
+}
+
+static struct stream * leaf_stream(
+	int id, fieldmap_t fields, size_t mem_budget, void *data
+) {
+	const struct leaf_data *d = data;
+	struct stream *s = input_stream(d->in, d->sets, id);
+	if (d->sorted && id < d->in->valid)
+		return stream_create_check(s, fields, d->in->v[id].fname, MIN_ID+id);
+	return stream_create_sort(s, fields, mem_budget);
+}
 
-static struct tnode * tnode_parse(char *s, char max_id, struct src_array *sets)
+static void tnode_count_ids(const struct tnode *e, unsigned *cnt)
 {
-	struct tnode *r;
-	yyscan_t scanner;
-	YY_BUFFER_STATE state;
+	if (!e)
+		return;
+	if (e->type == TNODE_ID)
+		cnt[e->id]++;
+	for (unsigned i=0; i<e->n; i++)
+		tnode_count_ids(e->ch[i], cnt);
+}
 
-	if (yylex_init(&scanner))
-		DIE(1,"error initializing scanner: %s\n", strerror(errno));
-	state = yy_scan_string(s, scanner);
-	if (yyparse(&r, scanner, max_id, sets))
-		DIE(1,"error parsing '%s'\n", s);
-	yy_delete_buffer(state, scanner);
-	yylex_destroy(scanner);
-	return r;
+/* ORs to need[id] the fields of all nodes from a leaf of input id up to the
+ * root, where above are those of e's ancestors */
+static void tnode_input_fields(
+	const struct tnode *e, fieldmap_t above, fieldmap_t *need
+) {
+	if (!e)
+		return;
+	above |= e->fields;
+	if (e->type == TNODE_ID)
+		need[e->id] |= above;
+	for (unsigned i=0; i<e->n; i++)
+		tnode_input_fields(e->ch[i], above, need);
+}
+
+/* Sets the number of fields to split the lines of each input into to the
+ * highest field any node handling its records selects, or that is in keep.
+ * Stdin is read once for all its occurrences, so they all get the largest
+ * one. */
+static void limit_fields(
+	struct input_array *in, size_t nids, const struct tnode *e, fieldmap_t keep
+) {
+	fieldmap_t *need = ck_calloc(nids, sizeof(*need)), std = 0;
+	struct input *i;
+	tnode_input_fields(e, keep, need);
+	varr_forall(i,in)
+		if (!strcmp(i->fname, "-"))
+			std |= need[i - in->v];
+	varr_forall(i,in) {
+		fieldmap_t f = need[i - in->v];
+		if (f && !strcmp(i->fname, "-"))
+			f = std;
+		i->o.nfields = f ? LOG2(f) + 1 : 0;
+	}
+	free(need);
+}
+
+static char *stdin_spool;
+
+static void stdin_spool_remove(void)
+{
+	remove(stdin_spool);
+}
+
+/* stdin can only be read once, so copy it to a file if it is referenced
+ * multiple times */
+static void spool_stdin(struct input_array *in, const struct tnode *e)
+{
+	unsigned cnt[MAX_IDS] = { 0 }, n = 0;
+	struct input *i;
+	char buf[BUFSIZ];
+	size_t rd;
+	FILE *f;
+
+	tnode_count_ids(e, cnt);
+	varr_forall(i,in)
+		if (!strcmp(i->fname, "-"))
+			n += cnt[i - in->v];
+	if (n < 2)
+		return;
+
+	f = stream_tmpfile(&stdin_spool);
+	atexit(stdin_spool_remove);
+	while ((rd = fread(buf, 1, sizeof(buf), stdin)))
+		if (fwrite(buf, 1, rd, f) != rd)
+			DIE(1,"error writing temporary file: %s\n",strerror(errno));
+	if (ferror(stdin))
+		DIE(1,"error reading stdin: %s\n",strerror(errno));
+	if (fclose(f))
+		DIE(1,"error writing temporary file: %s\n",strerror(errno));
+	varr_forall(i,in)
+		if (!strcmp(i->fname, "-"))
+			i->fname = stdin_spool;
+}
+
+static size_t parse_size(const char *s)
+{
+	char *endptr;
+	unsigned long long v;
+	errno = 0;
+	v = strtoull(s, &endptr, 10);
+	if (errno || endptr == s)
+		DIE(1,"error: invalid SIZE '%s'\n",s);
+	switch (*endptr) {
+	case 't': case 'T': v <<= 10; /* fall through */
+	case 'g': case 'G': v <<= 10; /* fall through */
+	case 'm': case 'M': v <<= 10; /* fall through */
+	case 'k': case 'K': v <<= 10; endptr++; /* fall through */
+	case '\0': break;
+	}
+	if (*endptr || !v)
+		DIE(1,"error: invalid SIZE '%s'\n",s);
+	return v;
+}
+
+#define WRITER_BUF_SZ	((size_t)1 << 16)
+
+/* output of entries collected in a buffer and written in large blocks */
+struct writer {
+	int fd;
+	const char *osep;
+	size_t osep_len;
+	char eol;
+	char *buf;
+	size_t n;	/* used of WRITER_BUF_SZ chars at buf */
+	int err;	/* of the first failed write, later ones are dropped */
+};
+
+/* returns 0 or the errno of the failed write */
+static int write_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt) {
+		ssize_t r = writev(fd, iov, cnt);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		for (; cnt && (size_t)r >= iov->iov_len; iov++, cnt--)
+			r -= iov->iov_len;
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+static void writer_init(struct writer *w, int fd, const char *osep, char eol)
+{
+	*w = (struct writer){ fd, osep, strlen(osep), eol, ck_malloc(WRITER_BUF_SZ), 0, 0 };
+}
+
+/* appends p[0:n], writing the buffer along with it if it does not fit */
+static void writer_put(struct writer *w, const char *p, size_t n)
+{
+	if (likely(n <= WRITER_BUF_SZ - w->n)) {
+		memcpy(w->buf + w->n, p, n);
+		w->n += n;
+		return;
+	}
+	struct iovec iov[2] = { { w->buf, w->n }, { (char *)p, n } };
+	if (!w->err)
+		w->err = write_all(w->fd, iov, 2);
+	w->n = 0;
+}
+
+/* returns 0 or the errno of the first failed write */
+static int writer_fini(struct writer *w)
+{
+	struct iovec iov = { w->buf, w->n };
+	if (!w->err)
+		w->err = write_all(w->fd, &iov, 1);
+	free(w->buf);
+	return w->err;
+}
+
+static void writer_str(struct writer *w, const struct str *s, fieldmap_t fields)
+{
+	int first = 1;
+	for (unsigned i=0; i<s->n && i<=MAX_FIELD; i++)
+		if (fields & ((fieldmap_t)1 << i)) {
+			struct field f = str_field(s, i);
+			if (!first)
+				writer_put(w, w->osep, w->osep_len);
+			writer_put(w, s->s + f.from, f.len);
+			first = 0;
+		}
+	writer_put(w, &w->eol, 1);
+}
+
+/* Prints an estimate of the number of entries of e's result and a bound on
+ * its standard error. Every input is read once into a sketch of its keys, so
+ * memory does not grow with the inputs. */
+static void print_estimate(
+	const struct input_array *in, const struct src_array *sets,
+	const struct tnode *e, struct writer *w
+) {
+	unsigned *cnt = ck_calloc(sets->valid, sizeof(*cnt)), n = 0;
+	struct hll *sk = ck_calloc(sets->valid, sizeof(*sk));
+	const struct hll *std = NULL;
+	fieldmap_t f = e->fields;
+	double est, err;
+	char buf[64];
+	size_t id;
+
+	if (!tnode_is_uniform_tree(e, f))
+		DIE(1,"error: option '-E' requires all operands of EXPR to have the same FIELDS\n");
+	tnode_count_ids(e, cnt);
+	for (id=0; id<sets->valid; id++)
+		n += !!cnt[id];
+	if (n > ESTIMATE_MAX_IDS)
+		DIE(1,"error: option '-E' supports at most %d distinct inputs\n",
+		    ESTIMATE_MAX_IDS);
+
+	for (id=0; id<sets->valid; id++) {
+		int is_stdin = id < in->valid && !strcmp(in->v[id].fname, "-");
+		const struct str *t;
+		if (!cnt[id])
+			continue;
+		if (is_stdin && std) {
+			sk[id] = *std;
+			continue;
+		}
+		struct stream *s = input_stream(in, sets, id);
+		while ((t = stream_next(s)))
+			if (f & str_fields(t))
+				hll_add(sk + id, str_hash(t, f));
+		stream_free(s);
+		if (is_stdin)
+			std = sk + id;
+	}
+	est = tnode_estimate(e, sk, &err);
+	writer_put(w, buf, snprintf(buf, sizeof(buf), "%.0f %.0f\n", est, err));
+	free(sk);
+	free(cnt);
+}
+
+/* fname made absolute wrt. the current directory, or NULL; to be freed */
+static char * abs_path(const char *fname)
+{
+	struct array p = ARRAY_INIT;
+	if (*fname != '/') {
+		array_ensure_sz(&p, 256, 0);
+		while (!getcwd(p.c, p.sz))
+			if (errno != ERANGE || array_ensure_sz(&p, 2 * p.sz, 0)) {
+				array_fini(&p);
+				return NULL;
+			}
+		p.valid = strlen(p.c);
+		array_append(&p, "/", 1, 1);
+	}
+	array_append(&p, fname, strlen(fname) + 1, 1);
+	return p.c;
+}
+
+/* the only input used by e if it is a file, or NULL */
+static const struct input * single_input(
+	const struct tnode *e, const struct input_array *in, size_t nids
+) {
+	unsigned *cnt = ck_calloc(nids, sizeof(*cnt)), n = 0;
+	const struct input *one = NULL;
+	tnode_count_ids(e, cnt);
+	for (size_t id=0; id<nids; id++)
+		if (cnt[id]) {
+			n++;
+			one = id < in->valid ? in->v + id : NULL;
+		}
+	free(cnt);
+	return n == 1 ? one : NULL;
+}
+
+/* Writes u, sorted and uniq'd wrt. fields, as index to path. If src is given,
+ * the index records it as its source and is built with its options instead
+ * of o. */
+static void write_index(
+	const char *path, const struct str_array *u, fieldmap_t fields,
+	const struct input *src, const struct iopts *o
+) {
+	struct sidx_src ss = { NULL, 0, 0, 0 };
+	struct stat st;
+	FILE *f;
+
+	if (src) {
+		o = &src->o;
+		if (strcmp(src->fname, "-") && !stat(src->fname, &st) &&
+		    (ss.path = abs_path(src->fname))) {
+			ss.size = st.st_size;
+			ss.mtime_sec = st.st_mtim.tv_sec;
+			ss.mtime_nsec = st.st_mtim.tv_nsec;
+		}
+	}
+	if (!(f = fopen(path, "w")))
+		DIE(1,"error opening '%s' for writing: %s\n",path,strerror(errno));
+	sidx_write(f, path, u, fields, o->isep,
+	           (o->trim ? SIDX_TRIM : 0) |
+	           (o->allow_empty ? SIDX_ALLOW_EMPTY : 0), &ss);
+	if (fclose(f))
+		DIE(1,"error writing index '%s': %s\n",path,strerror(errno));
+	free((char *)ss.path);
+}
+
+/* reads the delta file path of input in into r, sorted and uniq'd wrt. f;
+ * the records are owned by the input appended to dfiles */
+static void read_delta(
+	const char *path, const struct input *in, char desc,
+	struct str_array *r, fieldmap_t f, struct input_array *dfiles
+) {
+	struct input d = { (char *)path, in->o, ARENA_INIT, NULL, 0, NULL, NULL };
+	struct str_array *stdin_data = NULL;
+	if (!path)
+		return;
+	read_input(&d, desc, r, &stdin_data, NULL);
+	sort_uniq(r, f, NULL);
+	varr_append(dfiles,&d,1,1);
+}
+
+/* Appends to r the entries of input in with the keys wrt. f in keys. An
+ * index sorted wrt. f is searched without loading it, other inputs are read
+ * completely. */
+static void read_keys(
+	struct input *in, char desc, struct str_array *r,
+	const struct str_array *keys, fieldmap_t f
+) {
+	struct str_array *stdin_data = NULL, a;
+	struct sidx x;
+	const struct str *k;
+	ssize_t i;
+	FILE *fp;
+
+	if ((fp = fopen(in->fname, "r")) && sidx_map(&x, fileno(fp), in->fname)) {
+		if (x.h->fields == f) {
+			sidx_check(&x, &in->o, desc);
+			fclose(fp);
+			in->map = x.map;
+			in->map_sz = x.sz;
+			varr_forall(k,keys)
+				if ((i = sidx_find(&x, k)) >= 0) {
+					struct str t = sidx_get(&x, i);
+					varr_append(r,&t,1,1);
+				}
+			return;
+		}
+		sidx_unmap(&x);
+	}
+	if (fp)
+		fclose(fp);
+	read_input(in, desc, &a, &stdin_data, NULL);
+	sort_uniq(&a, f, NULL);
+	str_restrict(r, &a, keys, f);
+	varr_fini(&a);
+}
+
+/* writes the entries of del and add, sorted wrt. f, prefixed by '-' and '+'
+ * in the order of their keys; only f is printed, so keys in both are not */
+static void write_delta(
+	struct writer *w, const struct str_array *del,
+	const struct str_array *add, fieldmap_t f
+) {
+	size_t i = 0, j = 0;
+	while (i < del->valid || j < add->valid) {
+		int d = i == del->valid ? +1
+		      : j == add->valid ? -1
+		      : str_xcmp(del->v + i, f, add->v + j, f);
+		if (!d) {
+			i++, j++;
+			continue;
+		}
+		if (d < 0) {
+			writer_put(w, "-", 1);
+			writer_str(w, del->v + i++, f);
+		} else {
+			writer_put(w, "+", 1);
+			writer_str(w, add->v + j++, f);
+		}
+	}
+}
+
+/* Checks that prev, the index of the result before the change, agrees with
+ * the change del, add: it contains the entries of del but none with keys
+ * only in add. */
+static void check_prev(
+	const struct sidx *prev, const struct str_array *del,
+	const struct str_array *add, fieldmap_t f
+) {
+	size_t j = 0;
+	ssize_t i;
+	struct str r;
+	const struct str *s;
+	varr_forall(s,del)
+		if ((i = sidx_find(prev, s)) < 0 ||
+		    (r = sidx_get(prev, i), str_xcmp(&r, ~(fieldmap_t)0, s, ~(fieldmap_t)0)))
+			goto mismatch;
+	varr_forall(s,add) {
+		while (j < del->valid && str_xcmp(del->v + j, f, s, f) < 0)
+			j++;
+		if ((j == del->valid || str_xcmp(del->v + j, f, s, f)) &&
+		    sidx_find(prev, s) >= 0)
+			goto mismatch;
+	}
+	return;
+mismatch:
+	DIE(1,"error: '%s' is not the result of EXPR on the inputs\n",prev->name);
+}
+
+/* Incremental evaluation, option '-i': prints the entries leaving and
+ * entering the result of e when the inputs change by their delta files
+ * of removed (-r) and added or replaced (-a) lines. Only the entries with
+ * changed keys are looked up and evaluated. prev is the previous result as
+ * index, which is checked against the change and, if index_out is given,
+ * updated to it. */
+static void eval_incremental(
+	struct input_array *in, struct src_array *sets, const struct tnode *e,
+	const char *prev, const char *index_out, const struct iopts *o,
+	struct writer *w
+) {
+	fieldmap_t f = e->fields;
+	size_t nids = sets->valid, id;
+	unsigned *cnt = ck_calloc(nids, sizeof(*cnt));
+	struct str_array *add = ck_calloc(nids, sizeof(*add));
+	struct str_array *del = ck_calloc(nids, sizeof(*del));
+	struct str_array *before = ck_calloc(nids, sizeof(*before));
+	struct str_array *after = ck_calloc(nids, sizeof(*after));
+	struct str_array keys = VARR_INIT, dr = VARR_INIT, ar = VARR_INIT;
+	struct input_array dfiles = VARR_INIT;
+	struct input *d;
+	struct sidx x;
+	FILE *fp;
+
+	if (!tnode_is_uniform_tree(e, f))
+		DIE(1,"error: option '-i' requires all operands of EXPR to have the same FIELDS\n");
+	if (!(fp = fopen(prev, "r")))
+		DIE(1,"error opening '%s': %s\n",prev,strerror(errno));
+	if (!sidx_map(&x, fileno(fp), prev) || x.h->fields != f)
+		DIE(1,"error: '%s' is no result of EXPR written by option '-o'\n",prev);
+	fclose(fp);
+
+	tnode_count_ids(e, cnt);
+	for (id=0; id<in->valid; id++) {
+		struct input *i = in->v + id;
+		if (!cnt[id])
+			continue;
+		if (!strcmp(i->fname, "-"))
+			DIE(1,"error: option '-i' does not support stdin as input\n");
+		read_delta(i->del, i, MIN_ID+id, del + id, f, &dfiles);
+		read_delta(i->add, i, MIN_ID+id, add + id, f, &dfiles);
+		varr_append_a(&keys,del+id,1);
+		varr_append_a(&keys,add+id,1);
+	}
+	sort_uniq(&keys, f, NULL);
+
+	for (id=0; id<nids; id++) {
+		if (!cnt[id])
+			continue;
+		if (id < in->valid) {
+			read_keys(in->v + id, MIN_ID+id, before + id, &keys, f);
+			str_apply(after + id, before + id, del + id, add + id, f);
+		} else {
+			sort_uniq(sets->v + id, f, NULL);
+			str_restrict(before + id, sets->v + id, &keys, f);
+			varr_append_a(after+id,before+id,0);
+		}
+	}
+	tnode_delta(e, before, after, &dr, &ar);
+	check_prev(&x, &dr, &ar, f);
+	write_delta(w, &dr, &ar, f);
+
+	if (index_out) {
+		struct str_array p = VARR_INIT, u = VARR_INIT;
+		varr_ensure_sz(&p,x.h->nrec,0);
+		for (p.valid=0; p.valid<x.h->nrec; p.valid++)
+			p.v[p.valid] = sidx_get(&x, p.valid);
+		str_apply(&u, &p, &dr, &ar, f);
+		write_index(index_out, &u, f, NULL, o);
+		varr_fini(&u);
+		varr_fini(&p);
+	}
+
+	sidx_unmap(&x);
+	for (id=0; id<nids; id++) {
+		varr_fini(add + id);
+		varr_fini(del + id);
+		varr_fini(before + id);
+		varr_fini(after + id);
+	}
+	varr_forall(d,&dfiles) {
+		arena_fini(&d->arena);
+		if (d->map)
+			munmap(d->map, d->map_sz);
+	}
+	varr_fini(&dfiles);
+	varr_fini(&keys);
+	varr_fini(&dr);
+	varr_fini(&ar);
+	free(after);
+	free(before);
+	free(del);
+	free(add);
+	free(cnt);
+}
+
+/* --------------------------------------------------------------------------
+ * server mode, option '-S'
+ * -------------------------------------------------------------------------- */
+
+/* seconds between checks of the inputs for changes */
+#define SERVER_POLL_SEC	1
+/* max. length of a request */
+#define REQUEST_MAX	((size_t)1 << 20)
+
+/* An input loaded by the server, in the order of its file, which decides the
+ * entries representing equal keys as in setop(1). It is immutable and
+ * replaced as a whole when its file changes; requests hold references to the
+ * versions they started with. The file is copied rather than mapped, as it
+ * may be rewritten in place or truncated while they do. */
+struct loaded {
+	unsigned refs;		/* protected by server.mtx */
+	struct input in;
+	struct str_array r;
+	char *data;		/* contents of the file the records point into */
+	struct stat st;		/* of the file when it was read */
+};
+
+struct server {
+	pthread_mutex_t mtx;
+	struct loaded **cur;	/* by input id */
+	struct stat *failed;	/* of the files whose last reload failed */
+	size_t n;
+	struct pool *pool;	/* for loading */
+	const char *osep;
+	char eol;
+};
+
+static volatile sig_atomic_t server_stop;
+
+static void server_signal(int sig)
+{
+	server_stop = 1;
+}
+
+/* Reads the file of l->in into l->data and splits it into l->r, or uses it
+ * in place if it is an index. Errors are reported, returns 0 then. */
+static int server_read(struct loaded *l, char desc, struct pool *pool)
+{
+	const struct input *in = &l->in;
+	size_t sz, len = 0;
+	struct sidx x;
+	FILE *f;
+
+	if (!(f = fopen(in->fname, "r")) || fstat(fileno(f), &l->st)) {
+		fprintf(stderr, "error opening '%s' for %c: %s\n", in->fname, desc,
+		        strerror(errno));
+		if (f)
+			fclose(f);
+		return 0;
+	}
+	/* the file may grow while it is read */
+	sz = l->st.st_size > 0 ? l->st.st_size + 1 : BUFSIZ;
+	l->data = ck_malloc(sz);
+	while (!feof(f) && !ferror(f)) {
+		if (len == sz)
+			l->data = ck_realloc(l->data, sz *= 2);
+		len += fread(l->data + len, 1, sz - len, f);
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "error reading '%s' for %c: %s\n", in->fname, desc,
+		        strerror(errno));
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	switch (sidx_load(&x, l->data, len, in->fname)) {
+	case -1:
+		fprintf(stderr, "error: index '%s' for %c is corrupt or of another "
+		        "version\n", in->fname, desc);
+		return 0;
+	case 1:
+		if (sidx_stale(&x, &in->o, desc))
+			return 0;
+		varr_ensure_sz(&l->r,x.h->nrec,0);
+		for (l->r.valid=0; l->r.valid<x.h->nrec; l->r.valid++)
+			l->r.v[l->r.valid] = sidx_get(&x, l->r.valid);
+		return 1;
+	}
+	parse_lines(&in->o, l->data, l->data + len, &l->in.arena, &l->r, pool);
+	return 1;
+}
+
+static void loaded_free(struct loaded *l)
+{
+	arena_fini(&l->in.arena);
+	free(l->data);
+	varr_fini(&l->r);
+	free(l);
+}
+
+static void server_put(struct server *sv, struct loaded *l)
+{
+	pthread_mutex_lock(&sv->mtx);
+	unsigned refs = --l->refs;
+	pthread_mutex_unlock(&sv->mtx);
+	if (!refs)
+		loaded_free(l);
+}
+
+/* returns NULL if in cannot be read, the error is reported */
+static struct loaded * server_load(
+	const struct input *in, char desc, struct pool *pool
+) {
+	struct loaded *l = ck_calloc(1, sizeof(*l));
+	l->refs = 1;
+	l->in = *in;
+	l->in.arena = (struct arena)ARENA_INIT;
+	l->in.map = NULL;
+	/* expressions are not known in advance */
+	l->in.o.nfields = MAX_FIELD + 1;
+	l->r = (struct str_array)VARR_INIT;
+	if (!server_read(l, desc, pool)) {
+		loaded_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+static int stat_changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_ino != b->st_ino || a->st_size != b->st_size ||
+	       a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+	       a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+/* reloads inputs whose files changed; requests in flight keep evaluating on
+ * the versions they started with. If a reload fails, the previous version
+ * is kept until the file changes again. */
+static void * server_watch(void *arg)
+{
+	struct server *sv = arg;
+	struct stat st;
+	while (!server_stop) {
+		sleep(SERVER_POLL_SEC);
+		for (size_t id=0; id<sv->n && !server_stop; id++) {
+			struct loaded *l = sv->cur[id], *old;
+			if (stat(l->in.fname, &st) || !stat_changed(&st, &l->st) ||
+			    !stat_changed(&st, sv->failed + id))
+				continue;
+			if (!(l = server_load(&l->in, MIN_ID+id, sv->pool))) {
+				fprintf(stderr, "keeping the previous version of '%s' "
+				        "for %c\n", sv->cur[id]->in.fname,
+				        (char)(MIN_ID+id));
+				sv->failed[id] = st;
+				continue;
+			}
+			fprintf(stderr, "reloaded '%s' for %c\n", l->in.fname,
+			        (char)(MIN_ID+id));
+			pthread_mutex_lock(&sv->mtx);
+			old = sv->cur[id];
+			sv->cur[id] = l;
+			pthread_mutex_unlock(&sv->mtx);
+			server_put(sv, old);
+		}
+	}
+	return NULL;
+}
+
+struct request {
+	struct server *sv;
+	int fd;
+};
+
+/* reads the request up to the first newline into a, returns 0 on errors */
+static int request_read(int fd, struct array *a)
+{
+	char buf[BUFSIZ], *nl = NULL;
+	ssize_t rd;
+	while (!nl && (rd = read(fd, buf, sizeof(buf)))) {
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if ((nl = memchr(buf, '\n', rd)))
+			rd = nl - buf;
+		if (a->valid + rd >= REQUEST_MAX)
+			return 0;
+		array_append(a, buf, rd, 1);
+	}
+	array_append(a, "", 1, 1);
+	return 1;
+}
+
+/* Evaluates the expression received on q->fd and sends back a status line
+ * "ok" followed by the result, or "error: ..." */
+static void * server_request(void *arg)
+{
+	struct request *q = arg;
+	struct server *sv = q->sv;
+	struct loaded **l = ck_malloc(sv->n * sizeof(*l));
+	struct src_array sets = VARR_INIT;
+	struct array expr = ARRAY_INIT;
+	struct str_array *t;
+	struct tnode *e = NULL;
+	struct writer w;
+	char err[TNODE_ERR_MAX];
+	size_t id;
+
+	pthread_mutex_lock(&sv->mtx);
+	for (id=0; id<sv->n; id++)
+		(l[id] = sv->cur[id])->refs++;
+	pthread_mutex_unlock(&sv->mtx);
+	/* literal sets of the request are appended to the shared inputs */
+	varr_ensure_sz(&sets,sv->n,0);
+	for (id=0; id<sv->n; id++)
+		sets.v[id] = l[id]->r;
+	sets.valid = sv->n;
+
+	writer_init(&w, q->fd, sv->osep, sv->eol);
+	if (!request_read(q->fd, &expr)) {
+		const char msg[] = "error: cannot read request\n";
+		writer_put(&w, msg, sizeof(msg)-1);
+	} else if (!(e = tnode_parse(expr.c, MIN_ID + sv->n - 1, &sets, err))) {
+		char msg[TNODE_ERR_MAX + 16];
+		writer_put(&w, msg, snprintf(msg, sizeof(msg), "error: %s\n", err));
+	} else {
+		struct str_array u;
+		struct str *s;
+		e = tnode_optimize(tnode_flatten(e), sets.v);
+		tnode_share(e);
+		tnode_eval_shared(e, sets.v, NULL, tnode_eval);
+		u = tnode_eval(e, sets.v, NULL);
+		writer_put(&w, "ok\n", 3);
+		varr_forall(s,&u)
+			writer_str(&w, s, e->fields);
+		varr_fini(&u);
+	}
+	writer_fini(&w);
+	close(q->fd);
+
+	for (t = sets.v + sv->n; t < sets.v + sets.valid; t++) {
+		struct str *s;
+		varr_forall(s,t) {
+			free(s->s);
+			free(s->f);
+		}
+		varr_fini(t);
+	}
+	varr_fini(&sets);
+	if (e)
+		tnode_tree_free(e);
+	array_fini(&expr);
+	for (id=0; id<sv->n; id++)
+		server_put(sv, l[id]);
+	free(l);
+	free(q);
+	return NULL;
+}
+
+/* Loads the inputs in and serves requests on the Unix domain socket path
+ * until SIGINT or SIGTERM: each connection sends one EXPR terminated by a
+ * newline and is answered by a status line and the result. */
+static void serve(
+	const char *path, const struct input_array *in, unsigned nthreads,
+	const char *osep, char eol
+) {
+	struct server sv = {
+		PTHREAD_MUTEX_INITIALIZER, NULL, NULL, in->valid, NULL, osep, eol
+	};
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = server_signal };
+	sigset_t stop, orig;
+	pthread_attr_t attr;
+	pthread_t watch;
+	int fd, c, r;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		DIE(1,"error: socket path '%s' is too long\n",path);
+	strcpy(addr.sun_path, path);
+
+	if (nthreads > 1)
+		sv.pool = pool_create(nthreads);
+	sv.cur = ck_calloc(sv.n, sizeof(*sv.cur));
+	sv.failed = ck_calloc(sv.n, sizeof(*sv.failed));
+	for (size_t id=0; id<sv.n; id++) {
+		if (!strcmp(in->v[id].fname, "-"))
+			DIE(1,"error: option '-S' does not support stdin as input\n");
+		if (!(sv.cur[id] = server_load(in->v + id, MIN_ID+id, sv.pool)))
+			exit(1);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		DIE(1,"error creating socket: %s\n",strerror(errno));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN))
+		DIE(1,"error binding socket '%s': %s\n",path,strerror(errno));
+
+	/* SIGINT and SIGTERM are only delivered to this thread while waiting in
+	 * pselect(), all threads created inherit the blocked mask */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, &orig);
+	if ((r = pthread_create(&watch, NULL, server_watch, &sv)))
+		DIE(1,"error creating thread: %s\n",strerror(r));
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (!server_stop) {
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		if (pselect(fd + 1, &rfds, NULL, NULL, NULL, &orig) < 0) {
+			if (errno == EINTR)
+				continue;
+			DIE(1,"error waiting on '%s': %s\n",path,strerror(errno));
+		}
+		if ((c = accept(fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			DIE(1,"error accepting on '%s': %s\n",path,strerror(errno));
+		}
+		struct request *q = ck_malloc(sizeof(*q));
+		pthread_t t;
+		*q = (struct request){ &sv, c };
+		if ((r = pthread_create(&t, &attr, server_request, q))) {
+			fprintf(stderr, "error creating thread: %s\n", strerror(r));
+			close(c);
+			free(q);
+		}
+	}
+	close(fd);
+	unlink(path);
+	/* requests still in flight are cut off by exit() */
+	pthread_join(watch, NULL);
+	pthread_attr_destroy(&attr);
+	for (size_t id=0; id<sv.n; id++)
+		server_put(&sv, sv.cur[id]);
+	free(sv.cur);
+	free(sv.failed);
+	if (sv.pool)
+		pool_free(sv.pool);
 }
 
 int main(int argc, char **argv)
 {
+	struct input_array files = VARR_INIT;
 	struct src_array inputs = VARR_INIT;
-	struct str_array *stdin_data = NULL;
 #if YYDEBUG
 	yydebug = 1;
 #endif
@@ -174,68 +1214,188 @@ int main(int argc, char **argv)
 	int   opt;
 	int   n;
 	int   verbosity = 0;
+	size_t mem_budget = 0;
+	int   assume_sorted = 0;
+	int   unordered = 0;
+	int   keydict = 0;
+	int   count_only = 0;
+	int   estimate = 0;
+	char *index_out = NULL;
+	char *prev = NULL, *add = NULL, *del = NULL;
+	char *sock_path = NULL;
+	char  eol = '\n';
+	unsigned nthreads = 1;
 	char *expr = NULL;
 	char *osep = SETOP_DEF_OSEP;
 	struct iopts iopts = {
 		SETOP_DEF_ISEP,
 		1,
 		0,
+		0,
 	};
 	for (n=-1; optind < argc; n++) {
-		while ((opt = getopt(argc, argv, ":d:D:ehtv")) != -1)
+		while ((opt = getopt(argc, argv, ":0a:cd:D:eEhi:j:kM:o:r:sS:tuv")) != -1)
 			switch (opt) {
+			case '0': eol = '\0'; break;
+			case 'a': add = optarg; break;
+			case 'c': count_only = 1; break;
 			case 'd': iopts.isep = optarg; break;
 			case 'D': osep = optarg; break;
 			case 'e': iopts.allow_empty = 1; break;
+			case 'E': estimate = 1; break;
 			case 'h': DIE(0,USAGE "\n" HELP,argv[0]);
+			case 'i': prev = optarg; break;
+			case 'j':
+				nthreads = strtoul(optarg, &endptr, 10);
+				if (*endptr || !*optarg || !nthreads)
+					DIE(1,"error: invalid number of threads '%s'\n",optarg);
+				break;
+			case 'k': keydict = 1; break;
+			case 'M': mem_budget = parse_size(optarg); break;
+			case 'o': index_out = optarg; break;
+			case 'r': del = optarg; break;
+			case 's': assume_sorted = 1; break;
+			case 'S': sock_path = optarg; break;
 			case 't': iopts.trim = 0; break;
+			case 'u': unordered = 1; break;
 			case 'v': verbosity++; break;
 			case '?': DIE(1,"error: unknown option '-%c'\n",optopt);
 			case ':': DIE(1,"error: option '-%c' requires an argument\n",optopt);
 			}
 		if (optind < argc) {
-			if (n < 0)
+			if (n < 0 && !sock_path) {
 				expr = argv[optind++];
-			else {
-				varr_append(&inputs,(&(struct str_array)VARR_INIT),1,1);
-				read_input(argv[optind++], MIN_ID+n, &iopts, inputs.v+n, &stdin_data);
+			} else {
+				varr_append(&files,(&(struct input){ argv[optind++], iopts, ARENA_INIT, NULL, 0, add, del }),1,1);
+				add = del = NULL;
 			}
 		}
 	}
-	if (!expr)
+	/* the server takes no EXPR */
+	if (sock_path)
+		n = files.valid;
+	if (!expr && !sock_path)
 		DIE(1,USAGE,argv[0]);
 	if (n > MAX_IDS)
 		DIE(1,"error: max. %d inputs supported\n",MAX_IDS);
+	if (unordered && (mem_budget || assume_sorted))
+		DIE(1,"error: option '-u' cannot be combined with '-M' or '-s'\n");
+	if (keydict && (unordered || mem_budget || assume_sorted))
+		DIE(1,"error: option '-k' cannot be combined with '-u', '-M' or '-s'\n");
+	if (estimate && (count_only || keydict || unordered || mem_budget || assume_sorted))
+		DIE(1,"error: option '-E' cannot be combined with '-c', '-k', '-u', '-M' or '-s'\n");
+	if (index_out && (count_only || estimate || unordered || mem_budget || assume_sorted))
+		DIE(1,"error: option '-o' cannot be combined with '-c', '-E', '-u', '-M' or '-s'\n");
+	if (prev && (count_only || estimate || keydict || unordered || mem_budget || assume_sorted))
+		DIE(1,"error: option '-i' cannot be combined with '-c', '-E', '-k', '-u', '-M' or '-s'\n");
+	if (sock_path && (count_only || estimate || prev || index_out || keydict ||
+	                  unordered || mem_budget || assume_sorted))
+		DIE(1,"error: option '-S' cannot be combined with '-c', '-E', '-i', '-o', '-k', '-u', '-M' or '-s'\n");
+	if (sock_path) {
+		serve(sock_path, &files, nthreads, osep, eol);
+		varr_fini(&files);
+		return 0;
+	}
+	for (size_t i=0; i<files.valid && !prev; i++)
+		if (files.v[i].add || files.v[i].del)
+			DIE(1,"error: options '-a' and '-r' require option '-i'\n");
+
+	/* EXPR is parsed first to know which fields of which inputs are needed;
+	 * literal sets are appended to inputs by then, which must not be
+	 * resized while reading as a repeated stdin points to the records of
+	 * its first occurrence. Streaming, estimating and incremental
+	 * evaluation read the inputs only during evaluation. */
+	int streaming = mem_budget || assume_sorted;
+	int loading = !streaming && !estimate && !prev;
+	varr_ensure_sz(&inputs,files.valid,0);
+	inputs.valid = files.valid;
+	char msg[TNODE_ERR_MAX];
+	struct tnode *e = tnode_parse(expr, MIN_ID + n - 1, &inputs, msg);
+	if (!e)
+		DIE(1,"error: %s\nerror parsing '%s'\n", msg, expr);
+	e = tnode_flatten(e);
+	/* an index keeps all fields of the records, so they are compared with
+	 * the previous result and written to the next one */
+	limit_fields(&files, inputs.valid, e,
+	             index_out || prev ? ~(fieldmap_t)0 : 0);
 
-	struct tnode *e = tnode_parse(expr, MIN_ID + n - 1, &inputs);
+	struct pool *p = loading && nthreads > 1 ? pool_create(nthreads) : NULL;
+	if (loading)
+		read_inputs(&files, inputs.v, p);
+	if (loading)
+		e = tnode_optimize(e, inputs.v);
+	/* only the evaluation of loaded inputs fetches shared results; the
+	 * incremental one evaluates twice, which would fetch them again */
+	if (loading)
+		tnode_share(e);
 	if (verbosity > 0) {
 		tnode_dump(stderr, e);
 		fprintf(stderr, "\n");
 	}
 
-	struct str_array u = tnode_eval(e, inputs.v);
+	struct writer w;
+	size_t cnt = 0;
 	struct str *s;
-	varr_forall(s,&u) {
-		int first = 1;
-		for (unsigned i=0; i<s->n; i++)
-			if (e->fields & ((fieldmap_t)1 << i)) {
-				printf("%s%.*s", first ? "" : osep,
-				       (int)s->f[i].len, s->s + s->f[i].from);
-				first = 0;
-			}
-		printf("\n");
+	writer_init(&w, STDOUT_FILENO, osep, eol);
+	if (estimate) {
+		print_estimate(&files, &inputs, e, &w);
+	} else if (prev) {
+		eval_incremental(&files, &inputs, e, prev, index_out, &iopts, &w);
+	} else if (streaming) {
+		struct leaf_data d = { &files, &inputs, assume_sorted };
+		const struct str *t;
+		spool_stdin(&files, e);
+		struct stream *r = stream_create_tnode(
+			e, mem_budget ? mem_budget : SIZE_MAX, leaf_stream, &d);
+		for (; (t = stream_next(r)); cnt++)
+			if (!count_only)
+				writer_str(&w, t, e->fields);
+		stream_free(r);
+	} else {
+		tnode_eval_f *eval = unordered ? tnode_eval_hash : tnode_eval;
+		struct str_array u;
+		if (keydict) {
+			u = tnode_eval_dict(e, inputs.v, p);
+		} else {
+			tnode_eval_shared(e, inputs.v, p, eval);
+			u = eval(e, inputs.v, p);
+		}
+		if (p)
+			pool_free(p);
+		cnt = u.valid;
+		if (index_out)
+			write_index(index_out, &u, e->fields,
+			            single_input(e, &files, inputs.valid), &iopts);
+		else if (!count_only)
+			varr_forall(s,&u)
+				writer_str(&w, s, e->fields);
+		varr_fini(&u);
 	}
-	varr_fini(&u);
+	if (count_only) {
+		char buf[32];
+		writer_put(&w, buf, snprintf(buf, sizeof(buf), "%zu\n", cnt));
+	}
+	int err = writer_fini(&w);
+	if (err)
+		DIE(1,"error writing output: %s\n",strerror(err));
 
 	struct str_array *t;
 	varr_forall(t,&inputs) {
-		varr_forall(s,t) {
-			free(s->s);
-			free(s->f);
+		struct input *in = t - inputs.v < files.valid ? files.v + (t - inputs.v) : NULL;
+		if (in) {
+			arena_fini(&in->arena);
+			if (in->map)
+				munmap(in->map, in->map_sz);
+		} else {
+			varr_forall(s,t) {
+				free(s->s);
+				free(s->f);
+			}
 		}
 		varr_fini(t);
 	}
 	varr_fini(&inputs);
+	varr_fini(&files);
 
 	tnode_tree_free(e);
 
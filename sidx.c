@@ -0,0 +1,218 @@
+
+#include <unistd.h>		/* pread() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sidx.h"
+
+#define SIDX_CORRUPT(x)	DIE(1,"error: index '%s' is corrupt\n",(x)->name)
+
+static uint64_t sidx_align(uint64_t n, uint64_t align)
+{
+	return n + (-n & (align - 1));
+}
+
+static uint64_t sidx_rec_start(const struct sidx_hdr *h)
+{
+	return sidx_align(sizeof(*h) + (uint64_t)h->isep_len + 1 +
+	                  (uint64_t)h->src_len + 1, 8);
+}
+
+/* sets the pointers of x into x->map[0:x->sz] to the parts of the index
+ * with header h, returns 0 if they are out of bounds */
+static int sidx_layout(struct sidx *x, const struct sidx_hdr *h)
+{
+	uint64_t start = sidx_rec_start(h);
+	if (start > x->sz || h->nrec > (x->sz - start) / sizeof(*x->rec))
+		return 0;
+	x->h = (const struct sidx_hdr *)x->map;
+	x->isep = x->map + sizeof(*h);
+	x->src = x->isep + h->isep_len + 1;
+	x->rec = (const struct sidx_rec *)(x->map + start);
+	return !x->isep[h->isep_len] && !x->src[h->src_len];
+}
+
+int sidx_map(struct sidx *x, int fd, const char *name)
+{
+	struct sidx_hdr h;
+	struct stat st;
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    memcmp(h.magic, SIDX_MAGIC, sizeof(h.magic)))
+		return 0;
+	x->name = name;
+	if (h.version != SIDX_VERSION)
+		DIE(1,"error: index '%s' has unsupported version %u\n",name,
+		    (unsigned)h.version);
+	if (fstat(fd, &st))
+		DIE(1,"error: stat '%s': %s\n",name,strerror(errno));
+	if ((uintmax_t)st.st_size > SIZE_MAX)
+		DIE(1,"error: index '%s' too large to be mapped\n",name);
+	x->sz = st.st_size;
+	x->map = mmap(NULL, x->sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (x->map == MAP_FAILED)
+		DIE(1,"error mapping index '%s': %s\n",name,strerror(errno));
+	if (!sidx_layout(x, &h))
+		SIDX_CORRUPT(x);
+	return 1;
+}
+
+/* record i of x, returns 0 if it is out of bounds */
+static int sidx_rec_get(const struct sidx *x, size_t i, struct str *s)
+{
+	struct sidx_rec r = x->rec[i];
+	size_t fsz;
+	*s = (struct str){ NULL, NULL, r.n, !!r.narrow };
+	fsz = str_fsz(s);
+	if (r.off % alignof(struct field) || r.off > x->sz ||
+	    r.n > x->sz || fsz > x->sz - r.off)
+		return 0;
+	s->f = x->map + r.off;
+	s->s = x->map + r.off + fsz;
+	return str_extent(s) <= x->sz - r.off - fsz;
+}
+
+int sidx_load(struct sidx *x, char *buf, size_t sz, const char *name)
+{
+	const struct sidx_hdr *h = (const struct sidx_hdr *)buf;
+	struct str s;
+
+	if (sz < sizeof(*h) || memcmp(h->magic, SIDX_MAGIC, sizeof(h->magic)))
+		return 0;
+	x->name = name;
+	x->map = buf;
+	x->sz = sz;
+	if (h->version != SIDX_VERSION || !sidx_layout(x, h))
+		return -1;
+	for (size_t i=0; i<h->nrec; i++)
+		if (!sidx_rec_get(x, i, &s))
+			return -1;
+	return 1;
+}
+
+void sidx_unmap(struct sidx *x)
+{
+	munmap(x->map, x->sz);
+	x->map = NULL;
+}
+
+struct str sidx_get(const struct sidx *x, size_t i)
+{
+	struct str s;
+	if (!sidx_rec_get(x, i, &s))
+		SIDX_CORRUPT(x);
+	return s;
+}
+
+ssize_t sidx_find(const struct sidx *x, const struct str *s)
+{
+	fieldmap_t f = x->h->fields;
+	size_t lo = 0, hi = x->h->nrec;
+	struct str r;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		r = sidx_get(x, mid);
+		if (str_xcmp(&r, f, s, f) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == x->h->nrec || (r = sidx_get(x, lo), str_xcmp(&r, f, s, f)))
+		return -1;
+	return lo;
+}
+
+struct sidx_stream {
+	struct stream base;
+	struct sidx x;
+	size_t i;
+	struct str cur;
+};
+
+static const struct str * sidx_stream_next(struct stream *t)
+{
+	struct sidx_stream *s = (struct sidx_stream *)t;
+	if (s->i == s->x.h->nrec)
+		return NULL;
+	s->cur = sidx_get(&s->x, s->i++);
+	return &s->cur;
+}
+
+static void sidx_stream_free(struct stream *t)
+{
+	struct sidx_stream *s = (struct sidx_stream *)t;
+	sidx_unmap(&s->x);
+	free(s);
+}
+
+struct stream * stream_create_sidx(struct sidx *x)
+{
+	struct sidx_stream *s = ck_calloc(1, sizeof(*s));
+	s->base.next = sidx_stream_next;
+	s->base.free = sidx_stream_free;
+	s->x = *x;
+	posix_madvise(s->x.map, s->x.sz, POSIX_MADV_SEQUENTIAL);
+	return &s->base;
+}
+
+/* the stored record of s is narrow if its text is short enough */
+static struct sidx_rec sidx_rec_of(const struct str *s, uint64_t off)
+{
+	struct str t = *s;
+	t.narrow = str_extent(s) <= STR_NARROW_MAX;
+	return (struct sidx_rec){ off, s->n, t.narrow };
+}
+
+static uint64_t sidx_rec_sz(const struct str *s, const struct sidx_rec *r)
+{
+	struct str t = *s;
+	t.narrow = r->narrow;
+	return sidx_align(str_fsz(&t) + str_extent(s), alignof(struct field));
+}
+
+void sidx_write(
+	FILE *f, const char *name, const struct str_array *a, fieldmap_t fields,
+	const char *isep, uint32_t flags, const struct sidx_src *src
+) {
+	static const char zero[8];
+	const char *path = src && src->path ? src->path : "";
+	struct sidx_hdr h = {
+		SIDX_MAGIC, SIDX_VERSION, fields, flags,
+		strlen(isep), strlen(path), 0,
+		src ? src->size : 0,
+		src ? src->mtime_sec : 0, src ? src->mtime_nsec : 0,
+		a->valid,
+	};
+	uint64_t start = sidx_rec_start(&h), off;
+	const struct str *s;
+
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(isep, 1, h.isep_len + 1, f);
+	fwrite(path, 1, h.src_len + 1, f);
+	fwrite(zero, 1, start - (sizeof(h) + h.isep_len + 1 + h.src_len + 1), f);
+
+	off = start + a->valid * sizeof(struct sidx_rec);
+	varr_forall(s,a) {
+		struct sidx_rec r = sidx_rec_of(s, off);
+		fwrite(&r, sizeof(r), 1, f);
+		off += sidx_rec_sz(s, &r);
+	}
+	varr_forall(s,a) {
+		struct sidx_rec r = sidx_rec_of(s, 0);
+		size_t ext = str_extent(s);
+		for (unsigned i=0; i<s->n; i++) {
+			struct field g = str_field(s, i);
+			if (r.narrow)
+				fwrite(&(struct field16){ g.from, g.len },
+				       sizeof(struct field16), 1, f);
+			else
+				fwrite(&g, sizeof(g), 1, f);
+		}
+		fwrite(s->s, 1, ext, f);
+		struct str t = *s;
+		t.narrow = r.narrow;
+		fwrite(zero, 1, sidx_rec_sz(s, &r) - str_fsz(&t) - ext, f);
+	}
+	if (fflush(f) || ferror(f))
+		DIE(1,"error writing index '%s': %s\n",name,strerror(errno));
+}
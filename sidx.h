@@ -0,0 +1,83 @@
+
+#ifndef SIDX_H
+#define SIDX_H
+
+#include "tnode.h"
+#include "stream.h"
+
+/* Index files hold the records of a set already split into fields, sorted
+ * and uniq'd wrt. some fields. They are mapped instead of read: a record is
+ * its field table followed by its text, both used in place. The header
+ * records how the lines were split and which file they came from, so stale
+ * or mismatching indices are detected. Numbers are stored in host byte order.
+ *
+ * layout: struct sidx_hdr, isep, '\0', src, '\0', padding to 8 chars,
+ *         struct sidx_rec[nrec], records */
+
+#define SIDX_MAGIC	"SETOPIDX"
+#define SIDX_VERSION	1
+
+#define SIDX_TRIM		0x1
+#define SIDX_ALLOW_EMPTY	0x2
+
+struct sidx_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t fields;	/* the records are sorted and uniq'd wrt. */
+	uint32_t flags;		/* SIDX_* */
+	uint32_t isep_len, src_len;
+	uint32_t pad;
+	uint64_t src_size;	/* of the source when the index was built */
+	int64_t src_mtime_sec, src_mtime_nsec;
+	uint64_t nrec;
+};
+
+struct sidx_rec {
+	uint64_t off;		/* of the field table from the start of the file */
+	uint32_t n;
+	uint32_t narrow;
+};
+
+struct sidx {
+	const char *name;
+	char *map;
+	size_t sz;
+	const struct sidx_hdr *h;
+	const char *isep, *src;	/* src is empty if not a single file */
+	const struct sidx_rec *rec;
+};
+
+struct sidx_src {
+	const char *path;	/* absolute, or NULL */
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+};
+
+/* Maps the file fd if it is an index and returns 1, otherwise 0. Corrupt
+ * indices are fatal; name is used in the error message. */
+int sidx_map(struct sidx *x, int fd, const char *name);
+void sidx_unmap(struct sidx *x);
+
+/* Uses buf[0:sz] as index x if it is one, without mapping it; buf has to
+ * stay valid while x is used. Returns 1 for an index, 0 for other contents
+ * and -1 for a corrupt index or one of another version, which unlike
+ * sidx_map() is not fatal. All records are checked, so sidx_get() does not
+ * fail on x. */
+int sidx_load(struct sidx *x, char *buf, size_t sz, const char *name);
+
+/* record i of x pointing into its mapping */
+struct str sidx_get(const struct sidx *x, size_t i);
+
+/* index of the record of x equal to s wrt. the fields x is sorted by, or -1 */
+ssize_t sidx_find(const struct sidx *x, const struct str *s);
+
+/* yields the records of x and unmaps it when freed; takes ownership of x */
+struct stream * stream_create_sidx(struct sidx *x);
+
+/* writes the records of a, sorted and uniq'd wrt. fields, as index to f */
+void sidx_write(
+	FILE *f, const char *name, const struct str_array *a, fieldmap_t fields,
+	const char *isep, uint32_t flags, const struct sidx_src *src
+);
+
+#endif
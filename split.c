@@ -0,0 +1,298 @@
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# include <immintrin.h>
+# define HAVE_AVX2_TARGET
+#endif
+
+#include "split.h"
+
+static void iclass_masks_n(
+	const struct iclass *c, const unsigned char *s, unsigned n, uint64_t m[2]
+) {
+	m[0] = m[1] = 0;
+	for (unsigned i=0; i<n; i++) {
+		m[0] |= (uint64_t)!!(c->c[s[i]] & CLS_SEP) << i;
+		m[1] |= (uint64_t)!!(c->c[s[i]] & CLS_BLANK) << i;
+	}
+}
+
+static void iclass_masks_tab(
+	const struct iclass *c, const unsigned char *s, uint64_t m[2]
+) {
+	iclass_masks_n(c, s, 64, m);
+}
+
+#ifdef __SSE2__
+static void iclass_masks_sse2(
+	const struct iclass *c, const unsigned char *s, uint64_t m[2]
+) {
+	m[0] = m[1] = 0;
+	for (unsigned i=0; i<64; i+=16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+		for (unsigned k=0; k<2; k++) {
+			__m128i r = _mm_setzero_si128();
+			for (unsigned j=0; j<c->nv[k]; j++)
+				r = _mm_or_si128(r, _mm_cmpeq_epi8(x,
+					_mm_set1_epi8((char)c->v[k][j])));
+			m[k] |= (uint64_t)(unsigned)_mm_movemask_epi8(r) << i;
+		}
+	}
+	if (c->same)
+		m[1] = m[0];
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+static void iclass_masks_avx2(
+	const struct iclass *c, const unsigned char *s, uint64_t m[2]
+) {
+	m[0] = m[1] = 0;
+	for (unsigned i=0; i<64; i+=32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+		for (unsigned k=0; k<2; k++) {
+			__m256i r = _mm256_setzero_si256();
+			for (unsigned j=0; j<c->nv[k]; j++)
+				r = _mm256_or_si256(r, _mm256_cmpeq_epi8(x,
+					_mm256_set1_epi8((char)c->v[k][j])));
+			m[k] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(r) << i;
+		}
+	}
+	if (c->same)
+		m[1] = m[0];
+}
+#endif
+
+void iclass_init(struct iclass *c, const struct iopts *o)
+{
+	unsigned n[2] = { 0, 0 };
+	memset(c->c, 0, sizeof(c->c));
+	for (const char *p = o->isep; *p; p++)
+		c->c[(unsigned char)*p] |= CLS_SEP;
+	for (const char *p = BLANK; *p; p++)
+		c->c[(unsigned char)*p] |= CLS_BLANK;
+
+	c->same = 1;
+	for (unsigned k=0; k<=UCHAR_MAX; k++) {
+		if (!(c->c[k] & CLS_BLANK) != !(c->c[k] & CLS_SEP))
+			c->same = 0;
+		for (unsigned l=0; l<2; l++)
+			if (c->c[k] & (l ? CLS_BLANK : CLS_SEP) &&
+			    n[l]++ < ICLASS_VEC_MAX)
+				c->v[l][n[l]-1] = k;
+	}
+	if (c->same || !o->trim)
+		n[1] = 0;
+	c->nv[0] = n[0];
+	c->nv[1] = n[1];
+	c->same = c->same && o->trim;
+
+	c->masks = iclass_masks_tab;
+	if (n[0] > ICLASS_VEC_MAX)
+		return;
+#ifdef __SSE2__
+	c->masks = iclass_masks_sse2;
+#endif
+#ifdef HAVE_AVX2_TARGET
+	if (__builtin_cpu_supports("avx2"))
+		c->masks = iclass_masks_avx2;
+#endif
+}
+
+/* cursor over the separator and blank positions of a line */
+struct iscan {
+	const struct iclass *c;
+	const unsigned char *s;
+	size_t len;	/* of the line */
+	size_t avail;	/* readable chars at s, at least len */
+	size_t base;	/* m describes s[base:base+64] */
+	uint64_t m[2];
+};
+
+static void iscan_load(struct iscan *t, size_t base)
+{
+	size_t n = t->len - base;
+	t->base = base;
+	if (base + 64 <= t->avail)
+		t->c->masks(t->c, t->s + base, t->m);
+	else
+		iclass_masks_n(t->c, t->s + base, MIN(n, 64), t->m);
+	/* the end of the line terminates the last field and any blanks */
+	if (n < 64) {
+		t->m[0] |= ~(uint64_t)0 << n;
+		t->m[1] &= ~(~(uint64_t)0 << n);
+	}
+}
+
+/* returns the position of the first separator if sep is set, or non-blank
+ * otherwise, in s[i:len], or len if there is none */
+static size_t iscan_next(struct iscan *t, size_t i, int sep)
+{
+	while (i < t->len) {
+		if (i - t->base >= 64)
+			iscan_load(t, i);
+		uint64_t m = (sep ? t->m[0] : ~t->m[1]) >> (i - t->base);
+		if (m)
+			return MIN(i + LOG2(m & -m), t->len);
+		i = t->base + 64;
+	}
+	return t->len;
+}
+
+int entry_extract(
+	struct str *e, char *line, size_t len, size_t avail,
+	const struct iopts *o, const struct iclass *c, struct field_array *f
+) {
+	const unsigned char *s = (const unsigned char *)line;
+	struct iscan t = { c, s, len, avail };
+	e->s = line;
+	f->valid = 0;
+
+	iscan_load(&t, 0);
+	unsigned i = 0;
+	while (1) {
+		if (o->trim)
+			i = iscan_next(&t, i, 0);
+		unsigned fld_len = iscan_next(&t, i, 1) - i;
+		struct field g = { i, fld_len };
+		if (o->trim)
+			while (g.len && c->c[s[i+g.len-1]] & CLS_BLANK)
+				g.len--;
+		varr_append(f,&g,1,1);
+#if DEBUG
+		fprintf(stderr, "extracted field %d '%.*s'\n",
+			(int)f->valid-1, (int)g.len, e->s + g.from);
+#endif
+		/* no node looks at the remaining fields */
+		if (f->valid == o->nfields)
+			break;
+		i += fld_len;
+		/* the end of the line terminates the last field */
+		if (i >= len)
+			break;
+		i++;
+	}
+	e->f = f->v;
+	e->n = f->valid;
+	e->narrow = 0;
+
+	return o->allow_empty || e->n;
+}
+
+struct str entry_store(
+	struct arena *a, const struct str *e, size_t len, int copy
+) {
+	struct str r = *e;
+	r.narrow = len <= STR_NARROW_MAX;
+	size_t fsz = str_fsz(&r);
+	char *p = arena_alloc(a, fsz + (copy ? len + 1 : 0), alignof(struct field));
+	if (r.narrow) {
+		struct field16 *h = (struct field16 *)p;
+		for (unsigned i=0; i<e->n; i++) {
+			struct field g = str_field(e, i);
+			h[i] = (struct field16){ g.from, g.len };
+		}
+	} else {
+		memcpy(p, e->f, fsz);
+	}
+	r.f = p;
+	if (copy) {
+		r.s = p + fsz;
+		*(char *)ck_memcpy(r.s, e->s, len) = '\0';
+	}
+	return r;
+}
+
+/* extracts the records of the lines in [p,end) into r, their field tables
+ * are allocated from a */
+static void parse_chunk(
+	const struct iopts *o, const struct iclass *c, char *p, char *end,
+	struct arena *a, struct str_array *r
+) {
+	struct field_array fa = VARR_INIT;
+	char *q;
+	for (; p < end; p = q + 1) {
+		if (!(q = memchr(p, '\n', end - p)))
+			q = end;
+		struct str e;
+		if (entry_extract(&e, p, q - p, end - p, o, c, &fa)) {
+			e = entry_store(a, &e, q - p, 0);
+			varr_append(r,&e,1,1);
+		}
+	}
+	varr_fini(&fa);
+}
+
+/* buffers at least this large are parsed in chunks on the pool */
+#define READ_PAR_MIN	((size_t)1 << 22)
+
+struct parse_task {
+	struct task t;
+	const struct iopts *o;
+	const struct iclass *c;
+	char *p, *end;
+	struct arena arena;
+	struct str_array r;
+};
+
+static void parse_task_run(struct task *t)
+{
+	struct parse_task *x = (struct parse_task *)t;
+	parse_chunk(x->o, x->c, x->p, x->end, &x->arena, &x->r);
+}
+
+/* Splits [p,end) into k chunks ending in newlines, parses them concurrently
+ * and appends the records to r in order. */
+static void parse_lines_par(
+	const struct iopts *o, const struct iclass *c, char *p, char *end,
+	struct arena *a, struct str_array *r, struct pool *pool, unsigned k
+) {
+	struct parse_task *x = ck_calloc(k, sizeof(*x));
+	size_t n = 0;
+	unsigned i;
+	char *q = p, *b;
+	for (i=0; i<k; i++) {
+		x[i].t.run = parse_task_run;
+		x[i].o = o;
+		x[i].c = c;
+		x[i].p = q;
+		b = p + (size_t)(end - p) * (i+1) / k;
+		if (i+1 == k)
+			q = end;
+		else if (b > q)
+			q = (b = memchr(b, '\n', end - b)) ? b + 1 : end;
+		x[i].end = q;
+		if (i)
+			pool_spawn(pool, &x[i].t);
+	}
+	parse_task_run(&x->t);
+	for (i=1; i<k; i++)
+		pool_join(pool, &x[i].t);
+	for (i=0; i<k; i++)
+		n += x[i].r.valid;
+	varr_ensure_sz(r,r->valid + n,0);
+	for (i=0; i<k; i++) {
+		if (x[i].r.valid)
+			varr_append(r,x[i].r.v,x[i].r.valid,0);
+		varr_fini(&x[i].r);
+		arena_merge(a, &x[i].arena);
+	}
+	free(x);
+}
+
+void parse_lines(
+	const struct iopts *o, char *p, char *end, struct arena *a,
+	struct str_array *r, struct pool *pool
+) {
+	struct iclass c;
+	unsigned k = pool ? pool_nthreads(pool) : 1;
+	iclass_init(&c, o);
+	k = MIN(k, (size_t)(end - p) / READ_PAR_MIN);
+	if (k > 1)
+		parse_lines_par(o, &c, p, end, a, r, pool, k);
+	else
+		parse_chunk(o, &c, p, end, a, r);
+}
@@ -0,0 +1,67 @@
+
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include "tnode.h"
+#include "arena.h"
+#include "pool.h"
+
+/* Splitting of lines into records: separators and blanks are found 64 chars
+ * at a time by vector compares where available. */
+
+#define BLANK	" \f\t\r\n"
+
+struct iopts {
+	char *isep;
+	unsigned trim : 1;
+	unsigned allow_empty : 1;
+	unsigned nfields;	/* split lines into at most this many fields;
+				 * 0 if the input is not referenced by EXPR */
+};
+
+enum { CLS_SEP = 1, CLS_BLANK = 2 };
+
+/* classes of at most this many chars are compared vector-wise */
+#define ICLASS_VEC_MAX	8
+
+/* character classes wrt. iopts used by entry_extract() */
+struct iclass {
+	unsigned char c[UCHAR_MAX+1];
+	/* chars of the separator and blank classes for the vector compares;
+	 * blanks are only needed when trimming and if they differ from the
+	 * separators */
+	unsigned char v[2][ICLASS_VEC_MAX], nv[2];
+	unsigned char same : 1;
+	/* sets bit i of m[0] and m[1] if s[i] is a separator or blank,
+	 * respectively, for the 64 chars at s */
+	void (*masks)(const struct iclass *c, const unsigned char *s, uint64_t m[2]);
+};
+
+
+VARR_DECL(field_array,struct field);
+
+void iclass_init(struct iclass *c, const struct iopts *o);
+
+/* splits line into fields collected in f; e->s will point to line and e->f
+ * to f's contents; avail >= len chars at line have to be readable */
+int entry_extract(
+	struct str *e, char *line, size_t len, size_t avail,
+	const struct iopts *o, const struct iclass *c, struct field_array *f
+);
+
+/* Stores e's field table in a, narrowed to struct field16 if the line is
+ * short enough. If copy is set, the len chars of e->s are placed right after
+ * the table. */
+struct str entry_store(
+	struct arena *a, const struct str *e, size_t len, int copy
+);
+
+/* Extracts the records of the lines in [p,end) into r, their field tables
+ * are allocated from a and their strings point into [p,end). Large buffers
+ * are parsed in chunks on pool if not NULL. */
+void parse_lines(
+	const struct iopts *o, char *p, char *end, struct arena *a,
+	struct str_array *r, struct pool *pool
+);
+
+#endif
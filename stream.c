@@ -0,0 +1,695 @@
+
+#include <unistd.h>		/* unlink() */
+
+#include "stream.h"
+#include "arena.h"
+
+#define SORT_FANIN	64
+/* an arena holds at least this much once a record is copied into it, so a
+ * smaller budget would spill every record */
+#define SORT_MIN_BUDGET	(2 * ARENA_MIN_BLK)
+
+/* --------------------------------------------------------------------------
+ * array stream
+ * -------------------------------------------------------------------------- */
+
+struct array_stream {
+	struct stream base;
+	const struct str_array *a;
+	size_t pos;
+};
+
+static const struct str * array_stream_next(struct stream *t)
+{
+	struct array_stream *s = (struct array_stream *)t;
+	return s->pos < s->a->valid ? s->a->v + s->pos++ : NULL;
+}
+
+static void array_stream_free(struct stream *t)
+{
+	free(t);
+}
+
+struct stream * stream_create_array(const struct str_array *a)
+{
+	struct array_stream *s = ck_malloc(sizeof(*s));
+	s->base.next = array_stream_next;
+	s->base.free = array_stream_free;
+	s->a = a;
+	s->pos = 0;
+	return &s->base;
+}
+
+/* --------------------------------------------------------------------------
+ * runs: temporary files of sorted records
+ * -------------------------------------------------------------------------- */
+
+FILE * stream_tmpfile(char **path)
+{
+	const char *dir = getenv("TMPDIR");
+	struct array p = ARRAY_INIT;
+	FILE *f;
+	int fd;
+
+	array_appendf(&p, "%s/setop.XXXXXX", dir && *dir ? dir : "/tmp");
+	if ((fd = mkstemp(p.c)) < 0)
+		DIE(1,"error creating temporary file '%s': %s\n",p.c,strerror(errno));
+	if (!(f = fdopen(fd, "w+")))
+		DIE(1,"error opening temporary file '%s': %s\n",p.c,strerror(errno));
+	if (path) {
+		*path = p.c;
+	} else {
+		unlink(p.c);
+		array_fini(&p);
+	}
+	return f;
+}
+
+/* a record along with the capacities of its buffers for reuse */
+struct rbuf {
+	struct str s;
+	size_t s_sz, f_sz;
+};
+
+static void rbuf_fini(struct rbuf *b)
+{
+	free(b->s.s);
+	free(b->s.f);
+}
+
+/* f_sz is in chars */
+static void rbuf_ensure(struct rbuf *b, size_t slen, size_t f_sz)
+{
+	if (b->s_sz < slen + 1)
+		b->s.s = ck_realloc(b->s.s, b->s_sz = 2 * (slen + 1));
+	if (b->f_sz < f_sz)
+		b->s.f = ck_realloc(b->s.f, b->f_sz = 2 * f_sz);
+}
+
+static void rbuf_copy(struct rbuf *b, const struct str *s)
+{
+	size_t slen = str_extent(s);
+	rbuf_ensure(b, slen, str_fsz(s));
+	*(char *)ck_memcpy(b->s.s, s->s, slen) = '\0';
+	memcpy(b->s.f, s->f, str_fsz(s));
+	b->s.n = s->n;
+	b->s.narrow = s->narrow;
+}
+
+static void run_write(FILE *f, const struct str *s)
+{
+	unsigned hdr[3] = { str_extent(s), s->n, s->narrow };
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(s->f, 1, str_fsz(s), f) != str_fsz(s) ||
+	    fwrite(s->s, 1, hdr[0], f) != hdr[0])
+		DIE(1,"error writing temporary file: %s\n",strerror(errno));
+}
+
+static int run_read(FILE *f, struct rbuf *b)
+{
+	unsigned hdr[3];
+	if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+		if (ferror(f))
+			DIE(1,"error reading temporary file: %s\n",strerror(errno));
+		return 0;
+	}
+	b->s.n = hdr[1];
+	b->s.narrow = hdr[2];
+	rbuf_ensure(b, hdr[0], str_fsz(&b->s));
+	if (fread(b->s.f, 1, str_fsz(&b->s), f) != str_fsz(&b->s) ||
+	    fread(b->s.s, 1, hdr[0], f) != hdr[0])
+		DIE(1,"error reading temporary file: %s\n",
+		    ferror(f) ? strerror(errno) : "truncated");
+	b->s.s[hdr[0]] = '\0';
+	return 1;
+}
+
+struct run {
+	FILE *f;
+	struct rbuf cur;
+	unsigned level;		/* number of merges it went through */
+};
+
+VARR_DECL(run_array,struct run);
+
+/* k-way merge of sorted runs removing duplicates wrt. fmap; of equal records
+ * the one of the first run is kept */
+struct merger {
+	struct run_array runs;
+	VARR_DECL_ANON(unsigned) heap;
+	fieldmap_t fmap;
+	struct rbuf out;
+};
+
+static int merger_less(const struct merger *m, unsigned i, unsigned j)
+{
+	unsigned a = m->heap.v[i], b = m->heap.v[j];
+	int d = str_xcmp(&m->runs.v[a].cur.s, m->fmap, &m->runs.v[b].cur.s, m->fmap);
+	return d < 0 || (!d && a < b);
+}
+
+static void merger_sift_down(struct merger *m, unsigned i)
+{
+	unsigned n = m->heap.valid;
+	while (2*i+1 < n) {
+		unsigned c = 2*i+1;
+		if (c+1 < n && merger_less(m, c+1, c))
+			c++;
+		if (!merger_less(m, c, i))
+			break;
+		unsigned t = m->heap.v[i];
+		m->heap.v[i] = m->heap.v[c];
+		m->heap.v[c] = t;
+		i = c;
+	}
+}
+
+/* reads the next record of the run on top of the heap */
+static void merger_advance_top(struct merger *m)
+{
+	struct run *r = m->runs.v + m->heap.v[0];
+	if (!run_read(r->f, &r->cur))
+		m->heap.v[0] = m->heap.v[--m->heap.valid];
+	merger_sift_down(m, 0);
+}
+
+static void merger_init(struct merger *m, struct run_array runs, fieldmap_t fmap)
+{
+	m->runs = runs;
+	m->heap.v = NULL;
+	m->heap.n = m->heap.valid = 0;
+	m->fmap = fmap;
+	m->out = (struct rbuf){ { NULL, NULL, 0, 0 }, 0, 0 };
+	varr_ensure_sz(&m->heap, runs.valid, 0);
+	for (unsigned i=0; i<runs.valid; i++) {
+		rewind(runs.v[i].f);
+		if (run_read(runs.v[i].f, &runs.v[i].cur))
+			m->heap.v[m->heap.valid++] = i;
+	}
+	for (unsigned i=m->heap.valid/2; i--;)
+		merger_sift_down(m, i);
+}
+
+static const struct str * merger_next(struct merger *m)
+{
+	if (!m->heap.valid)
+		return NULL;
+	struct run *r = m->runs.v + m->heap.v[0];
+	struct rbuf t = m->out;
+	m->out = r->cur;
+	r->cur = t;
+	merger_advance_top(m);
+	while (m->heap.valid &&
+	       !str_xcmp(&m->runs.v[m->heap.v[0]].cur.s, m->fmap,
+	                 &m->out.s, m->fmap))
+		merger_advance_top(m);
+	return &m->out.s;
+}
+
+static void merger_fini(struct merger *m)
+{
+	struct run *r;
+	varr_forall(r,&m->runs) {
+		fclose(r->f);
+		rbuf_fini(&r->cur);
+	}
+	varr_fini(&m->runs);
+	varr_fini(&m->heap);
+	rbuf_fini(&m->out);
+}
+
+/* --------------------------------------------------------------------------
+ * sort stream
+ * -------------------------------------------------------------------------- */
+
+struct sort_stream {
+	struct stream base;
+	struct stream *in;
+	fieldmap_t fmap;
+	size_t budget;
+	int consumed;
+	/* current in-memory chunk: records are copied into arena */
+	struct str_array chunk;
+	struct arena arena;
+	size_t pos;
+	/* spilled runs */
+	struct run_array runs;
+	struct merger m;
+};
+
+/* the chunk's capacity counts against the budget, so it is released, too */
+static void sort_stream_clear(struct sort_stream *s)
+{
+	arena_fini(&s->arena);
+	varr_fini(&s->chunk);
+	s->chunk = (struct str_array)VARR_INIT;
+}
+
+/* merges the n runs from s->runs.v[i] on into one, which takes their place */
+static void sort_stream_merge(struct sort_stream *s, size_t i, size_t n)
+{
+	struct run_array part = VARR_INIT;
+	struct run r = { stream_tmpfile(NULL), { { NULL, NULL, 0, 0 }, 0, 0 }, 0 };
+	const struct str *e;
+	for (size_t j=i; j<i+n; j++)
+		r.level = MAX(r.level, s->runs.v[j].level + 1);
+	varr_append(&part,s->runs.v+i,n,0);
+	merger_init(&s->m, part, s->fmap);
+	while ((e = merger_next(&s->m)))
+		run_write(r.f, e);
+	merger_fini(&s->m);
+	s->runs.v[i] = r;
+	memmove(s->runs.v + i+1, s->runs.v + i+n,
+	        (s->runs.valid - i-n) * sizeof(*s->runs.v));
+	s->runs.valid -= n-1;
+}
+
+/* Spills the chunk as a new run. As soon as SORT_FANIN runs of the same level
+ * follow each other at the end, they are merged into one of the next level,
+ * which bounds the number of open runs while consuming. */
+static void sort_stream_spill(struct sort_stream *s)
+{
+	struct run r = { stream_tmpfile(NULL), { { NULL, NULL, 0, 0 }, 0, 0 }, 0 };
+	struct str *e;
+	sort_uniq(&s->chunk, s->fmap, NULL);
+	varr_forall(e,&s->chunk)
+		run_write(r.f, e);
+	varr_append(&s->runs,&r,1,1);
+	sort_stream_clear(s);
+	while (s->runs.valid >= SORT_FANIN &&
+	       s->runs.v[s->runs.valid - SORT_FANIN].level ==
+	       s->runs.v[s->runs.valid - 1].level)
+		sort_stream_merge(s, s->runs.valid - SORT_FANIN, SORT_FANIN);
+}
+
+/* Merges runs until at most SORT_FANIN are left. Each pass merges groups of
+ * consecutive runs into one, so the runs stay in the order of the input. */
+static void sort_stream_reduce(struct sort_stream *s)
+{
+	while (s->runs.valid > SORT_FANIN)
+		for (size_t i=0; i+1<s->runs.valid; i++)
+			sort_stream_merge(s, i, MIN(SORT_FANIN, s->runs.valid - i));
+}
+
+static void sort_stream_consume(struct sort_stream *s)
+{
+	const struct str *e;
+	while ((e = stream_next(s->in))) {
+		size_t slen = str_extent(e);
+		struct str c = *e;
+		c.f = memcpy(arena_alloc(&s->arena, str_fsz(e), alignof(struct field)),
+		             e->f, str_fsz(e));
+		c.s = arena_alloc(&s->arena, slen + 1, 1);
+		*(char *)ck_memcpy(c.s, e->s, slen) = '\0';
+		varr_append(&s->chunk,&c,1,1);
+		if (s->arena.sz + s->chunk.n * sizeof(*s->chunk.v) > s->budget)
+			sort_stream_spill(s);
+	}
+	stream_free(s->in);
+	s->in = NULL;
+	if (!s->runs.valid) {
+		sort_uniq(&s->chunk, s->fmap, NULL);
+		return;
+	}
+	if (s->chunk.valid)
+		sort_stream_spill(s);
+	sort_stream_reduce(s);
+	merger_init(&s->m, s->runs, s->fmap);
+	s->runs = (struct run_array)VARR_INIT;
+}
+
+static const struct str * sort_stream_next(struct stream *t)
+{
+	struct sort_stream *s = (struct sort_stream *)t;
+	if (!s->consumed) {
+		sort_stream_consume(s);
+		s->consumed = 1;
+	}
+	if (s->m.runs.v)
+		return merger_next(&s->m);
+	return s->pos < s->chunk.valid ? s->chunk.v + s->pos++ : NULL;
+}
+
+static void sort_stream_free(struct stream *t)
+{
+	struct sort_stream *s = (struct sort_stream *)t;
+	stream_free(s->in);
+	sort_stream_clear(s);
+	varr_fini(&s->chunk);
+	if (s->m.runs.v)
+		merger_fini(&s->m);
+	free(s);
+}
+
+struct stream * stream_create_sort(
+	struct stream *in, fieldmap_t fmap, size_t mem_budget
+) {
+	struct sort_stream *s = ck_calloc(1, sizeof(*s));
+	s->base.next = sort_stream_next;
+	s->base.free = sort_stream_free;
+	s->in = in;
+	s->fmap = fmap;
+	s->budget = MAX(mem_budget, SORT_MIN_BUDGET);
+	return &s->base;
+}
+
+/* --------------------------------------------------------------------------
+ * check stream
+ * -------------------------------------------------------------------------- */
+
+/* Verifies that the input of -s is sorted and drops duplicates. Of equal
+ * records the first is kept, the one sort_uniq() would keep, so -s does
+ * not change the result. */
+struct check_stream {
+	struct stream base;
+	struct stream *in;
+	fieldmap_t fmap;
+	const char *name;
+	char desc;
+	size_t nr;
+	struct rbuf prev;
+};
+
+static const struct str * check_stream_next(struct stream *t)
+{
+	struct check_stream *s = (struct check_stream *)t;
+	const struct str *e;
+	while ((e = stream_next(s->in))) {
+		s->nr++;
+		if (!(s->fmap & str_fields(e)))
+			continue;
+		if (s->prev.s.s) {
+			int d = str_xcmp(&s->prev.s, s->fmap, e, s->fmap);
+			if (d > 0)
+				DIE(1,"error: '%s' for %c is not sorted wrt. fields "
+				    "0x%08x at record %zu\n",s->name,s->desc,s->fmap,s->nr);
+			if (!d)
+				continue;
+		}
+		rbuf_copy(&s->prev, e);
+		return e;
+	}
+	return NULL;
+}
+
+static void check_stream_free(struct stream *t)
+{
+	struct check_stream *s = (struct check_stream *)t;
+	stream_free(s->in);
+	rbuf_fini(&s->prev);
+	free(s);
+}
+
+struct stream * stream_create_check(
+	struct stream *in, fieldmap_t fmap, const char *name, char desc
+) {
+	struct check_stream *s = ck_calloc(1, sizeof(*s));
+	s->base.next = check_stream_next;
+	s->base.free = check_stream_free;
+	s->in = in;
+	s->fmap = fmap;
+	s->name = name;
+	s->desc = desc;
+	return &s->base;
+}
+
+/* --------------------------------------------------------------------------
+ * uniq stream
+ * -------------------------------------------------------------------------- */
+
+struct uniq_stream {
+	struct stream base;
+	struct stream *in;
+	fieldmap_t fmap;
+	struct rbuf prev;	/* first of the current duplicates */
+};
+
+static const struct str * uniq_stream_next(struct stream *t)
+{
+	struct uniq_stream *s = (struct uniq_stream *)t;
+	const struct str *e;
+	while ((e = stream_next(s->in))) {
+		if (!(s->fmap & str_fields(e)))
+			continue;
+		if (s->prev.s.s && !str_xcmp(&s->prev.s, s->fmap, e, s->fmap))
+			continue;
+		rbuf_copy(&s->prev, e);
+		return e;
+	}
+	return NULL;
+}
+
+static void uniq_stream_free(struct stream *t)
+{
+	struct uniq_stream *s = (struct uniq_stream *)t;
+	stream_free(s->in);
+	rbuf_fini(&s->prev);
+	free(s);
+}
+
+struct stream * stream_create_uniq(struct stream *in, fieldmap_t fmap)
+{
+	struct uniq_stream *s = ck_calloc(1, sizeof(*s));
+	s->base.next = uniq_stream_next;
+	s->base.free = uniq_stream_free;
+	s->in = in;
+	s->fmap = fmap;
+	return &s->base;
+}
+
+/* --------------------------------------------------------------------------
+ * set operations on sorted streams
+ * -------------------------------------------------------------------------- */
+
+struct op_stream {
+	struct stream base;
+	const struct tnode *e;
+	struct stream *ch[2];
+	const struct str *c[2];
+	unsigned started : 1;
+	unsigned adv0 : 1;
+	unsigned adv1 : 1;
+};
+
+/* mirrors the merge loops in tnode_eval() */
+static const struct str * op_stream_next(struct stream *t)
+{
+	struct op_stream *s = (struct op_stream *)t;
+	const struct tnode *e = s->e;
+	fieldmap_t fl = e->ch[0]->fields, fr = e->ch[1]->fields;
+
+	if (!s->started) {
+		s->c[0] = stream_next(s->ch[0]);
+		s->c[1] = stream_next(s->ch[1]);
+		s->started = 1;
+	}
+	if (s->adv0) s->c[0] = stream_next(s->ch[0]);
+	if (s->adv1) s->c[1] = stream_next(s->ch[1]);
+	s->adv0 = s->adv1 = 0;
+
+	while (s->c[0] || s->c[1]) {
+		const struct str *pl = s->c[0], *pr = s->c[1];
+		int d = !pl ? +1 : !pr ? -1 : str_xcmp(pl, fl, pr, fr);
+		const struct str *r = NULL;
+		switch (e->type) {
+		case TNODE_ID:
+			break;
+		case TNODE_SYMDIFF:
+			if (d)
+				r = d < 0 ? pl : pr;
+			break;
+		case TNODE_INTERS:
+			if (!pl || !pr)
+				return NULL;
+			if (!d)
+				r = e->ch[0]->id < e->ch[1]->id ? pl : pr;
+			break;
+		case TNODE_UNION:
+			r = d < 0 || (!d && e->ch[0]->id < e->ch[1]->id) ? pl : pr;
+			break;
+		case TNODE_DIFF:
+			if (!pl)
+				return NULL;
+			if (d < 0)
+				r = pl;
+			break;
+		}
+		if (r) {
+			s->adv0 = d <= 0;
+			s->adv1 = d >= 0;
+			return r;
+		}
+		if (d <= 0) s->c[0] = stream_next(s->ch[0]);
+		if (d >= 0) s->c[1] = stream_next(s->ch[1]);
+	}
+	return NULL;
+}
+
+static void op_stream_free(struct stream *t)
+{
+	struct op_stream *s = (struct op_stream *)t;
+	stream_free(s->ch[0]);
+	stream_free(s->ch[1]);
+	free(s);
+}
+
+/* k-way merge of the children of a flattened node, mirrors tnode_merge_n() */
+struct nop_stream {
+	struct stream base;
+	const struct tnode *e;
+	struct stream **ch;
+	const struct str **c;	/* current record of each child */
+	unsigned *heap, nh;
+	unsigned *eq, ne;	/* children to advance on the next call */
+	unsigned started : 1;
+};
+
+static int nop_stream_less(const struct nop_stream *s, unsigned i, unsigned j)
+{
+	return str_xcmp(s->c[s->heap[i]], s->e->fields,
+	                s->c[s->heap[j]], s->e->fields) < 0;
+}
+
+static void nop_stream_swap(struct nop_stream *s, unsigned i, unsigned j)
+{
+	unsigned t = s->heap[i];
+	s->heap[i] = s->heap[j];
+	s->heap[j] = t;
+}
+
+static void nop_stream_push(struct nop_stream *s, unsigned ch)
+{
+	unsigned i = s->nh++;
+	s->heap[i] = ch;
+	for (; i && nop_stream_less(s, i, (i-1)/2); i = (i-1)/2)
+		nop_stream_swap(s, i, (i-1)/2);
+}
+
+static unsigned nop_stream_pop(struct nop_stream *s)
+{
+	unsigned r = s->heap[0], i = 0, c;
+	s->heap[0] = s->heap[--s->nh];
+	while ((c = 2*i+1) < s->nh) {
+		if (c+1 < s->nh && nop_stream_less(s, c+1, c))
+			c++;
+		if (!nop_stream_less(s, c, i))
+			break;
+		nop_stream_swap(s, c, i);
+		i = c;
+	}
+	return r;
+}
+
+static void nop_stream_advance(struct nop_stream *s)
+{
+	for (unsigned j=0; j<s->ne; j++)
+		if ((s->c[s->eq[j]] = stream_next(s->ch[s->eq[j]])))
+			nop_stream_push(s, s->eq[j]);
+	s->ne = 0;
+}
+
+static const struct str * nop_stream_next(struct stream *t)
+{
+	struct nop_stream *s = (struct nop_stream *)t;
+	const struct tnode *e = s->e;
+	unsigned k = e->n, i, best;
+
+	if (!s->started) {
+		for (i=0; i<k; i++)
+			s->eq[s->ne++] = i;
+		s->started = 1;
+	}
+	for (nop_stream_advance(s);
+	     s->nh && (e->type != TNODE_INTERS || s->nh == k);
+	     nop_stream_advance(s)) {
+		const struct str *m = s->c[s->heap[0]];
+		best = s->heap[0];
+		do {
+			i = s->eq[s->ne++] = nop_stream_pop(s);
+			if (e->type == TNODE_SYMDIFF ? i > best :
+			    e->ch[i]->id < e->ch[best]->id ||
+			    (e->ch[i]->id == e->ch[best]->id && i > best))
+				best = i;
+		} while (s->nh && !str_xcmp(s->c[s->heap[0]], e->fields, m, e->fields));
+		if (e->type == TNODE_UNION ||
+		    (e->type == TNODE_INTERS && s->ne == k) ||
+		    (e->type == TNODE_SYMDIFF && s->ne % 2))
+			return s->c[best];
+	}
+	return NULL;
+}
+
+static void nop_stream_free(struct stream *t)
+{
+	struct nop_stream *s = (struct nop_stream *)t;
+	for (unsigned i=0; i<s->e->n; i++)
+		stream_free(s->ch[i]);
+	free(s->ch);
+	free(s->c);
+	free(s->heap);
+	free(s);
+}
+
+/* number of leaves and re-sorting nodes in the stream of e */
+static unsigned tnode_sort_stages(const struct tnode *e)
+{
+	fieldmap_t g;
+	unsigned n = e->type == TNODE_ID || !tnode_merge_order(e, &g) ||
+	             !fieldmap_is_prefix(e->fields, g);
+	for (unsigned i=0; i<e->n; i++)
+		n += tnode_sort_stages(e->ch[i]);
+	return n;
+}
+
+static struct stream * tnode_stream(
+	const struct tnode *e, size_t mem_budget,
+	struct stream * (*leaf)(int id, fieldmap_t fields, size_t mem_budget,
+	                        void *leaf_data),
+	void *leaf_data
+) {
+	if (e->type == TNODE_ID)
+		return leaf(e->id, e->fields, mem_budget, leaf_data);
+
+	struct stream *r;
+	if (e->n > 2) {
+		struct nop_stream *s = ck_calloc(1, sizeof(*s));
+		s->base.next = nop_stream_next;
+		s->base.free = nop_stream_free;
+		s->e = e;
+		s->ch = ck_calloc(e->n, sizeof(*s->ch));
+		s->c = ck_calloc(e->n, sizeof(*s->c));
+		s->heap = ck_calloc(2 * e->n, sizeof(*s->heap));
+		s->eq = s->heap + e->n;
+		for (unsigned i=0; i<e->n; i++)
+			s->ch[i] = tnode_stream(e->ch[i], mem_budget, leaf, leaf_data);
+		r = &s->base;
+	} else {
+		struct op_stream *s = ck_calloc(1, sizeof(*s));
+		s->base.next = op_stream_next;
+		s->base.free = op_stream_free;
+		s->e = e;
+		s->ch[0] = tnode_stream(e->ch[0], mem_budget, leaf, leaf_data);
+		s->ch[1] = tnode_stream(e->ch[1], mem_budget, leaf, leaf_data);
+		r = &s->base;
+	}
+	/* merging mostly keeps the children's order and uniqueness, which only
+	 * needs a re-sort if e->fields is not a prefix of theirs */
+	fieldmap_t g;
+	if (!tnode_merge_order(e, &g) || !fieldmap_is_prefix(e->fields, g))
+		return stream_create_sort(r, e->fields, mem_budget);
+	if (e->fields != g)
+		return stream_create_uniq(r, e->fields);
+	return r;
+}
+
+/* All sorts may hold their chunks at the same time: the leaves are consumed
+ * by the first record asked for and the re-sorting nodes above while the
+ * leaves still hold their last chunks. So each gets an equal share. */
+struct stream * stream_create_tnode(
+	const struct tnode *e, size_t mem_budget,
+	struct stream * (*leaf)(int id, fieldmap_t fields, size_t mem_budget,
+	                        void *leaf_data),
+	void *leaf_data
+) {
+	return tnode_stream(e, mem_budget / tnode_sort_stages(e), leaf, leaf_data);
+}
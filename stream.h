@@ -0,0 +1,67 @@
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "tnode.h"
+
+/* A stream yields records one at a time; the returned record is owned by the
+ * stream and stays valid until the next call to stream_next() or
+ * stream_free(). NULL signals the end of the stream. */
+struct stream {
+	const struct str * (*next)(struct stream *s);
+	void (*free)(struct stream *s);
+};
+
+static inline const struct str * stream_next(struct stream *s)
+{
+	return s->next(s);
+}
+
+static inline void stream_free(struct stream *s)
+{
+	if (s)
+		s->free(s);
+}
+
+/* yields the records of a, which must outlive the stream */
+struct stream * stream_create_array(const struct str_array *a);
+
+/* Sorts and uniq's the records of in wrt. fmap just like sort_uniq() does.
+ * Chunks exceeding mem_budget bytes, but at least 128K, are spilled as sorted
+ * runs to temporary files in $TMPDIR which are k-way merged again on output.
+ * Takes ownership of in. */
+struct stream * stream_create_sort(
+	struct stream *in, fieldmap_t fmap, size_t mem_budget
+);
+
+/* Passes on the records of in, which must already be sorted wrt. fmap, while
+ * verifying their order and skipping duplicates as well as records not having
+ * any of the fields in fmap. Out of order records are fatal; name and desc
+ * are used in the error message. Takes ownership of in. */
+struct stream * stream_create_check(
+	struct stream *in, fieldmap_t fmap, const char *name, char desc
+);
+
+/* Like stream_create_sort() for in already sorted wrt. fmap. Takes ownership
+ * of in. */
+struct stream * stream_create_uniq(struct stream *in, fieldmap_t fmap);
+
+/* Evaluates the expression e like tnode_eval() does, though records are
+ * merged on the fly. Leafs are obtained by leaf(id, fields, mem_budget,
+ * leaf_data) which must return a stream sorted and uniq'd wrt. fields. Inner
+ * nodes whose children are not already ordered wrt. the node's fields are
+ * passed through stream_create_sort(), those projecting to a prefix of their
+ * children's fields through stream_create_uniq(). mem_budget is split evenly
+ * among the leaves and these sorts. */
+struct stream * stream_create_tnode(
+	const struct tnode *e, size_t mem_budget,
+	struct stream * (*leaf)(int id, fieldmap_t fields, size_t mem_budget,
+	                        void *leaf_data),
+	void *leaf_data
+);
+
+/* returns a new FILE opened for "w+" in $TMPDIR (or /tmp); if path is NULL
+ * the file is removed right away, otherwise its name is stored in *path */
+FILE * stream_tmpfile(char **path);
+
+#endif
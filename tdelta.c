@@ -0,0 +1,74 @@
+
+#include "tnode.h"
+
+/* Incremental evaluation: if all nodes select the same fields, whether a key
+ * is in the result only depends on the entries with this key in the inputs.
+ * So a change of the inputs only affects the result wrt. the keys changed,
+ * and evaluating the tree on just the entries with these keys before and
+ * after the change yields the change of the result. */
+
+void str_restrict(
+	struct str_array *u, const struct str_array *a,
+	const struct str_array *keys, fieldmap_t f
+) {
+	size_t i = 0, j = 0;
+	while (i < a->valid && j < keys->valid) {
+		int d = str_xcmp(a->v + i, f, keys->v + j, f);
+		if (!d)
+			varr_append(u,a->v+i,1,1);
+		if (d <= 0) i++;
+		if (d >= 0) j++;
+	}
+}
+
+void str_apply(
+	struct str_array *u, const struct str_array *a,
+	const struct str_array *del, const struct str_array *add, fieldmap_t f
+) {
+	size_t i = 0, j = 0, k = 0;
+	while (i < a->valid || k < add->valid) {
+		int d = i == a->valid ? +1
+		      : k == add->valid ? -1
+		      : str_xcmp(a->v + i, f, add->v + k, f);
+		if (d >= 0) {
+			/* added entries replace those with the same key */
+			varr_append(u,add->v+k,1,1);
+			k++;
+			if (!d)
+				i++;
+			continue;
+		}
+		while (j < del->valid && str_xcmp(del->v + j, f, a->v + i, f) < 0)
+			j++;
+		if (j == del->valid || str_xcmp(del->v + j, f, a->v + i, f))
+			varr_append(u,a->v+i,1,1);
+		i++;
+	}
+}
+
+void tnode_delta(
+	const struct tnode *e, const struct str_array *before,
+	const struct str_array *after, struct str_array *del,
+	struct str_array *add
+) {
+	fieldmap_t f = e->fields;
+	struct str_array o = tnode_eval(e, before, NULL);
+	struct str_array n = tnode_eval(e, after, NULL);
+	size_t i = 0, j = 0;
+	while (i < o.valid || j < n.valid) {
+		int d = i == o.valid ? +1
+		      : j == n.valid ? -1
+		      : str_xcmp(o.v + i, f, n.v + j, f);
+		/* the same key may be represented by another entry now */
+		if (!d && !str_xcmp(o.v + i, ~(fieldmap_t)0, n.v + j, ~(fieldmap_t)0)) {
+			i++, j++;
+			continue;
+		}
+		if (d <= 0)
+			varr_append(del,o.v+i++,1,1);
+		if (d >= 0)
+			varr_append(add,n.v+j++,1,1);
+	}
+	varr_fini(&o);
+	varr_fini(&n);
+}
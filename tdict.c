@@ -0,0 +1,392 @@
+
+#include "tnode.h"
+
+/* Evaluation on dictionary-encoded keys: if all nodes of the tree select the
+ * same fields, the inputs it uses are sorted and uniq'd once and every
+ * distinct key among them gets a dense id in key order. The tree is then
+ * evaluated on sorted arrays of these ids, each paired with the entry
+ * representing it, and the entries are only looked up for the result. */
+
+struct kref {
+	uint32_t key;	/* dense id of the key */
+	uint32_t rec;	/* index of the representing entry in dict.v */
+};
+
+VARR_DECL(kref_array,struct kref);
+
+struct dict {
+	struct str_array v;		/* entries of all inputs used */
+	struct kref_array *in;		/* their keys, per input id */
+	unsigned nid;			/* number of input ids */
+	size_t nkeys;
+};
+
+int tnode_is_uniform_tree(const struct tnode *e, fieldmap_t f)
+{
+	if (e->fields != f)
+		return 0;
+	for (unsigned i=0; i<e->n; i++)
+		if (!tnode_is_uniform_tree(e->ch[i], f))
+			return 0;
+	return 1;
+}
+
+/* the id of inner nodes is the minimum of their children's */
+static int tnode_max_id(const struct tnode *e)
+{
+	int id = e->id;
+	for (unsigned i=0; i<e->n; i++)
+		id = MAX(id, tnode_max_id(e->ch[i]));
+	return id;
+}
+
+static void tnode_leaf_ids(const struct tnode *e, char *used)
+{
+	if (e->type == TNODE_ID)
+		used[e->id] = 1;
+	for (unsigned i=0; i<e->n; i++)
+		tnode_leaf_ids(e->ch[i], used);
+}
+
+/* one sorted and uniq'd input during the merge in dict_build() */
+struct dict_run {
+	size_t i, end;		/* in dict.v */
+	struct kref_array *in;
+};
+
+static int dict_run_less(
+	const struct dict *d, const struct dict_run *r, unsigned a, unsigned b,
+	fieldmap_t f
+) {
+	return str_xcmp(d->v.v + r[a].i, f, d->v.v + r[b].i, f) < 0;
+}
+
+static void dict_run_down(
+	const struct dict *d, struct dict_run *r, unsigned *h, unsigned nh,
+	unsigned i, fieldmap_t f
+) {
+	for (unsigned c; (c = 2*i+1) < nh; i = c) {
+		if (c+1 < nh && dict_run_less(d, r, h[c+1], h[c], f))
+			c++;
+		if (!dict_run_less(d, r, h[c], h[i], f))
+			break;
+		unsigned t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+	}
+}
+
+/* Fills d with the inputs of a used by e, all of whose nodes select f, and
+ * assigns their keys ids by a k-way merge. Returns 0 if there are too many
+ * entries for 32 bit indices. */
+static int dict_build(
+	struct dict *d, const struct tnode *e, fieldmap_t f,
+	const struct str_array *a, struct pool *p
+) {
+	unsigned nid = tnode_max_id(e) + 1, nh = 0, k = 0, id;
+	char *used = ck_calloc(nid, 1);
+	struct dict_run *r = ck_malloc(nid * sizeof(*r));
+	unsigned *h = ck_malloc(nid * sizeof(*h));
+	size_t n = 0;
+
+	tnode_leaf_ids(e, used);
+	for (id=0; id<nid; id++)
+		if (used[id])
+			n += a[id].valid;
+	if (n > UINT32_MAX) {
+		free(h);
+		free(r);
+		free(used);
+		return 0;
+	}
+
+	d->nid = nid;
+	d->in = ck_calloc(nid, sizeof(*d->in));
+	varr_ensure_sz(&d->v,n,0);
+	for (id=0; id<nid; id++) {
+		if (!used[id])
+			continue;
+		struct str_array u = VARR_INIT;
+		varr_append_a(&u,a+id,0);
+		sort_uniq(&u,f,p);
+		r[k] = (struct dict_run){ d->v.valid, d->v.valid + u.valid, d->in + id };
+		varr_ensure_sz(r[k].in,u.valid,0);
+		varr_append_a(&d->v,&u,0);
+		varr_fini(&u);
+		if (r[k].i < r[k].end)
+			h[nh++] = k;
+		k++;
+	}
+
+	for (unsigned i=nh/2; i--;)
+		dict_run_down(d, r, h, nh, i, f);
+	uint32_t key = 0;
+	size_t last = SIZE_MAX;
+	while (nh) {
+		struct dict_run *q = r + h[0];
+		if (last != SIZE_MAX &&
+		    str_xcmp(d->v.v + last, f, d->v.v + q->i, f))
+			key++;
+		last = q->i;
+		varr_append(q->in,(&(struct kref){ key, q->i }),1,1);
+		if (++q->i == q->end)
+			h[0] = h[--nh];
+		dict_run_down(d, r, h, nh, 0, f);
+	}
+	d->nkeys = last == SIZE_MAX ? 0 : (size_t)key + 1;
+	free(h);
+	free(r);
+	free(used);
+	return 1;
+}
+
+static void dict_fini(struct dict *d)
+{
+	for (unsigned id=0; id<d->nid; id++)
+		varr_fini(d->in + id);
+	free(d->in);
+	varr_fini(&d->v);
+}
+
+/* k-way merge of the flattened e's children's results r[0:e->n] */
+static void dict_merge_n(
+	struct kref_array *u, const struct tnode *e, const struct dict *d,
+	const struct kref_array *r
+) {
+	unsigned k = e->n, i, nd, best, live;
+	size_t *pos = ck_calloc(k, sizeof(*pos));
+	for (;;) {
+		uint32_t min = UINT32_MAX;
+		for (i=0, live=0; i<k; i++)
+			if (pos[i] < r[i].valid) {
+				live++;
+				min = MIN(min, r[i].v[pos[i]].key);
+			}
+		/* an intersection is done as soon as one child is */
+		if (!live || (e->type == TNODE_INTERS && live < k))
+			break;
+		for (i=0, nd=0, best=k; i<k; i++) {
+			if (pos[i] >= r[i].valid || r[i].v[pos[i]].key != min)
+				continue;
+			/* in a uniform tree children of the same id yield the
+			 * same entry; '^' takes the last as tnode_merge_n() */
+			if (best == k || e->type == TNODE_SYMDIFF ||
+			    e->ch[i]->id < e->ch[best]->id)
+				best = i;
+			nd++;
+		}
+		if (e->type == TNODE_UNION ||
+		    (e->type == TNODE_INTERS && nd == k) ||
+		    (e->type == TNODE_SYMDIFF && nd % 2))
+			varr_append(u,r[best].v + pos[best],1,1);
+		for (i=0; i<k; i++)
+			if (pos[i] < r[i].valid && r[i].v[pos[i]].key == min)
+				pos[i]++;
+	}
+	free(pos);
+}
+
+/* mirrors the merge loops in tnode_eval() */
+static struct kref_array dict_eval(const struct tnode *e, const struct dict *d)
+{
+	struct kref_array u = VARR_INIT;
+	if (e->type == TNODE_ID) {
+		varr_append_a(&u,d->in + e->id,0);
+		return u;
+	}
+	struct kref_array *ch = ck_malloc(e->n * sizeof(*ch));
+	for (unsigned i=0; i<e->n; i++)
+		ch[i] = dict_eval(e->ch[i], d);
+	if (e->n > 2) {
+		dict_merge_n(&u, e, d, ch);
+	} else {
+		const struct kref *pl = ch[0].v, *el = pl + ch[0].valid;
+		const struct kref *pr = ch[1].v, *er = pr + ch[1].valid;
+		int left_first = e->ch[0]->id < e->ch[1]->id;
+		varr_ensure_sz(&u,ch[0].valid + ch[1].valid,0);
+		while (pl < el || pr < er) {
+			/* intersections end with either side, differences with
+			 * the left one */
+			if ((e->type == TNODE_INTERS && (pl == el || pr == er)) ||
+			    (e->type == TNODE_DIFF && pl == el))
+				break;
+			int c = pl == el ? +1 : pr == er ? -1
+			      : SGN2(pl->key, pr->key);
+			switch (e->type) {
+			case TNODE_ID:
+				break;
+			case TNODE_UNION:
+				varr_append(&u,(c < 0 || (!c && left_first)) ? pl : pr,1,1);
+				break;
+			case TNODE_INTERS:
+				if (!c)
+					varr_append(&u,left_first ? pl : pr,1,1);
+				break;
+			case TNODE_DIFF:
+				if (c < 0)
+					varr_append(&u,pl,1,1);
+				break;
+			case TNODE_SYMDIFF:
+				if (c)
+					varr_append(&u,c < 0 ? pl : pr,1,1);
+				break;
+			}
+			if (c <= 0) pl++;
+			if (c >= 0) pr++;
+		}
+	}
+	for (unsigned i=0; i<e->n; i++)
+		varr_fini(ch + i);
+	free(ch);
+	return u;
+}
+
+/* Trees all of whose inputs hold at least 1/BITMAP_DENSITY of the keys are
+ * evaluated on bitmaps over the key ids: each node is a word-wise AND, OR,
+ * AND-NOT or XOR of its children's bitmaps. The bitmaps of all nodes are
+ * kept to find the representing entries of the result afterwards. */
+#define BITMAP_DENSITY	32
+
+struct bnode {
+	const struct tnode *e;
+	uint64_t *w;
+	struct bnode *ch;	/* e->n */
+};
+
+static int dict_is_dense(const struct dict *d, const struct tnode *e)
+{
+	if (e->type == TNODE_ID)
+		return d->in[e->id].valid * BITMAP_DENSITY >= d->nkeys;
+	for (unsigned i=0; i<e->n; i++)
+		if (!dict_is_dense(d, e->ch[i]))
+			return 0;
+	return 1;
+}
+
+static int bits_test(const uint64_t *w, uint32_t x)
+{
+	return w[x / 64] >> x % 64 & 1;
+}
+
+static void bits_eval(struct bnode *b, const struct tnode *e, const struct dict *d)
+{
+	size_t nw = (d->nkeys + 63) / 64, j;
+	unsigned i;
+	b->e = e;
+	b->w = ck_calloc(nw, sizeof(*b->w));
+	b->ch = e->n ? ck_malloc(e->n * sizeof(*b->ch)) : NULL;
+	if (e->type == TNODE_ID) {
+		const struct kref *k;
+		varr_forall(k,d->in + e->id)
+			b->w[k->key / 64] |= (uint64_t)1 << k->key % 64;
+		return;
+	}
+	for (i=0; i<e->n; i++)
+		bits_eval(b->ch + i, e->ch[i], d);
+	uint64_t *w = b->w;
+	memcpy(w, b->ch[0].w, nw * sizeof(*w));
+	for (i=1; i<e->n; i++) {
+		const uint64_t *v = b->ch[i].w;
+		switch (e->type) {
+		case TNODE_ID:
+			break;
+		case TNODE_UNION:   for (j=0; j<nw; j++) w[j] |=  v[j]; break;
+		case TNODE_INTERS:  for (j=0; j<nw; j++) w[j] &=  v[j]; break;
+		case TNODE_DIFF:    for (j=0; j<nw; j++) w[j] &= ~v[j]; break;
+		case TNODE_SYMDIFF: for (j=0; j<nw; j++) w[j] ^=  v[j]; break;
+		}
+	}
+}
+
+static void bits_fini(struct bnode *b)
+{
+	for (unsigned i=0; i<b->e->n; i++)
+		bits_fini(b->ch + i);
+	free(b->ch);
+	free(b->w);
+}
+
+/* Returns the index in d->v of the entry representing key x in the result
+ * of b, which contains it, by the rules of tnode_eval(). The keys are looked
+ * up in ascending order, so cur[id] only advances over d->in[id]. */
+static uint32_t bits_rep(
+	const struct bnode *b, const struct dict *d, uint32_t x, size_t *cur
+) {
+	const struct tnode *e = b->e;
+	unsigned c = 0, i;
+	if (e->type == TNODE_ID) {
+		const struct kref_array *in = d->in + e->id;
+		while (in->v[cur[e->id]].key < x)
+			cur[e->id]++;
+		return in->v[cur[e->id]].rec;
+	}
+	if (e->n > 2) {
+		uint32_t rec = 0;
+		for (i=0, c=e->n; i<e->n; i++) {
+			if (!bits_test(b->ch[i].w, x))
+				continue;
+			uint32_t r = bits_rep(b->ch + i, d, x, cur);
+			if (c == e->n || e->type == TNODE_SYMDIFF ||
+			    e->ch[i]->id < e->ch[c]->id) {
+				c = i;
+				rec = r;
+			}
+		}
+		return rec;
+	}
+	int in0 = bits_test(b->ch[0].w, x), in1 = bits_test(b->ch[1].w, x);
+	switch (e->type) {
+	case TNODE_ID:
+	case TNODE_DIFF:
+		break;
+	case TNODE_UNION:
+	case TNODE_INTERS:
+		c = in0 && in1 ? !(e->ch[0]->id < e->ch[1]->id) : !in0;
+		break;
+	case TNODE_SYMDIFF:
+		c = !in0;
+		break;
+	}
+	return bits_rep(b->ch + c, d, x, cur);
+}
+
+static void bits_result(
+	struct str_array *u, const struct tnode *e, const struct dict *d
+) {
+	struct bnode b;
+	size_t *cur = ck_calloc(d->nid, sizeof(*cur));
+	bits_eval(&b, e, d);
+	for (size_t j=0; j<(d->nkeys + 63) / 64; j++)
+		for (uint64_t m = b.w[j]; m; m &= m - 1) {
+			uint32_t x = j * 64 + LOG2(m & -m);
+			varr_append(u,d->v.v + bits_rep(&b, d, x, cur),1,1);
+		}
+	bits_fini(&b);
+	free(cur);
+}
+
+struct str_array tnode_eval_dict(
+	const struct tnode *e, const struct str_array *a, struct pool *p
+) {
+	struct str_array u = VARR_INIT;
+	struct dict d = { VARR_INIT, NULL, 0 };
+	struct kref *k;
+	if (!e)
+		return u;
+	if (!tnode_is_uniform_tree(e, e->fields) ||
+	    !dict_build(&d, e, e->fields, a, p)) {
+		tnode_eval_shared(e, a, p, tnode_eval);
+		return tnode_eval(e, a, p);
+	}
+	if (d.nkeys && dict_is_dense(&d, e)) {
+		bits_result(&u, e, &d);
+	} else {
+		struct kref_array r = dict_eval(e, &d);
+		varr_ensure_sz(&u,r.valid,0);
+		varr_forall(k,&r)
+			varr_append(&u,d.v.v + k->rec,1,1);
+		varr_fini(&r);
+	}
+	dict_fini(&d);
+	return u;
+}
@@ -0,0 +1,118 @@
+
+#include <math.h>
+
+#include "tnode.h"
+#include "hll.h"
+
+/* Estimation of result sizes on sketches: if all nodes select the same
+ * fields, whether a key is in the result of e only depends on the set of
+ * inputs it occurs in. So |e| is a sum over the Venn regions of the inputs,
+ * which by inclusion-exclusion is a signed sum of the sizes of unions of
+ * inputs. These are estimated by merging the inputs' HyperLogLog sketches. */
+
+static unsigned id_bit(const int *ids, unsigned k, int id)
+{
+	unsigned b = 0;
+	while (b < k && ids[b] != id)
+		b++;
+	return b;
+}
+
+/* whether a key occuring in exactly the inputs with bits in m is in e */
+static int tnode_member(
+	const struct tnode *e, const int *ids, unsigned k, unsigned m
+) {
+	if (e->type == TNODE_ID)
+		return m >> id_bit(ids, k, e->id) & 1;
+	int r = tnode_member(e->ch[0], ids, k, m);
+	for (unsigned i=1; i<e->n; i++) {
+		int c = tnode_member(e->ch[i], ids, k, m);
+		switch (e->type) {
+		case TNODE_ID: break;
+		case TNODE_UNION:   r |= c; break;
+		case TNODE_INTERS:  r &= c; break;
+		case TNODE_DIFF:    r &= !c; break;
+		case TNODE_SYMDIFF: r ^= c; break;
+		}
+	}
+	return r;
+}
+
+/* collects the distinct leaf ids of e in ids[0:*k], counting those beyond
+ * ESTIMATE_MAX_IDS only */
+static void tnode_leaf_bits(const struct tnode *e, int *ids, unsigned *k)
+{
+	unsigned n = MIN(*k, ESTIMATE_MAX_IDS);
+	if (e->type == TNODE_ID && id_bit(ids, n, e->id) == n && n == *k) {
+		if (*k < ESTIMATE_MAX_IDS)
+			ids[*k] = e->id;
+		++*k;
+	}
+	for (unsigned i=0; i<e->n; i++)
+		tnode_leaf_bits(e->ch[i], ids, k);
+}
+
+struct union_est {
+	const struct hll *s;
+	const int *ids;
+	const double *c;	/* coefficients of the unions */
+	struct hll *stack;	/* merged sketches of the prefixes of the DFS */
+	unsigned k;
+	double sum, err;
+};
+
+/* adds c[t] times the estimated size of the union of the inputs in t to
+ * x->sum for all t extending t0 by bits >= j, where t0's sketch is
+ * x->stack[d] */
+static void union_dfs(struct union_est *x, unsigned t0, unsigned j, unsigned d)
+{
+	for (unsigned b=j; b<x->k; b++) {
+		unsigned t = t0 | 1u << b;
+		struct hll *h = x->stack + d + 1;
+		*h = d ? x->stack[d] : x->s[x->ids[b]];
+		if (d)
+			hll_merge(h, x->s + x->ids[b]);
+		if (x->c[t]) {
+			double u = hll_estimate(h);
+			x->sum += x->c[t] * u;
+			x->err += fabs(x->c[t]) * HLL_REL_ERR * u;
+		}
+		union_dfs(x, t, b+1, d+1);
+	}
+}
+
+/* With g(W) the number of keys in all inputs of W and f(M) whether a key in
+ * exactly the inputs M is in e, |e| = sum_W a(W) g(W) where a is the Moebius
+ * transform of f over supersets. g(W) in turn is the number of keys in some
+ * input minus the number of those in none of W, i.e. u(all) - u(all \ W). */
+double tnode_estimate(const struct tnode *e, const struct hll *s, double *err)
+{
+	unsigned k = 0, m, w, i;
+	int ids[ESTIMATE_MAX_IDS];
+	tnode_leaf_bits(e, ids, &k);
+	if (k > ESTIMATE_MAX_IDS)
+		return -1;
+
+	unsigned all = (1u << k) - 1;
+	double *a = ck_malloc((all + 1) * sizeof(*a));
+	double *c = ck_calloc(all + 1, sizeof(*c));
+	for (m=0; m<=all; m++)
+		a[m] = tnode_member(e, ids, k, m);
+	for (i=0; i<k; i++)
+		for (w=0; w<=all; w++)
+			if (!(w >> i & 1))
+				a[w] -= a[w | 1u << i];
+	for (w=1; w<=all; w++) {
+		c[all] += a[w];
+		c[all & ~w] -= a[w];
+	}
+
+	struct union_est x = { s, ids, c, ck_malloc((k + 1) * sizeof(struct hll)), k, 0, 0 };
+	union_dfs(&x, 0, 0, 0);
+	free(x.stack);
+	free(c);
+	free(a);
+
+	*err = x.err;
+	return MAX(x.sum, 0);
+}
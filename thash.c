@@ -0,0 +1,275 @@
+
+#include "tnode.h"
+
+#define HASH_MUL	0x9e3779b97f4a7c15ULL
+
+static uint64_t hash_bytes(uint64_t h, const char *p, size_t n)
+{
+	uint64_t w;
+	for (; n >= sizeof(w); p += sizeof(w), n -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * HASH_MUL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, p, n);
+	h = (h ^ w ^ (uint64_t)n << 56) * HASH_MUL;
+	return h ^ h >> 29;
+}
+
+uint64_t str_hash(const struct str *s, fieldmap_t fmap)
+{
+	uint64_t h = 0;
+	fieldmap_t fm = fmap & str_fields(s);
+	for (unsigned i = 0; fm; fm >>= 1, i++)
+		if (fm & 1) {
+			struct field f = str_field(s, i);
+			h = hash_bytes(h, s->s + f.from, f.len);
+		}
+	return h;
+}
+
+/* open addressing with linear probing on indices into a str_array */
+struct htab {
+	struct hslot {
+		uint64_t h;
+		size_t i;	/* 0 if empty, index + 1 otherwise */
+	} *v;
+	size_t mask;
+};
+
+static void htab_init(struct htab *t, size_t n)
+{
+	size_t sz = 16;
+	while (sz < 2 * n)
+		sz <<= 1;
+	t->v = ck_calloc(sz, sizeof(*t->v));
+	t->mask = sz - 1;
+}
+
+static void htab_fini(struct htab *t)
+{
+	free(t->v);
+}
+
+/* returns the slot of the entry of a equal to s, or the empty slot s goes to */
+static struct hslot * htab_find(
+	const struct htab *t, const struct str_array *a, fieldmap_t fa,
+	const struct str *s, fieldmap_t fs, uint64_t h
+) {
+	for (size_t j = h & t->mask;; j = (j+1) & t->mask) {
+		struct hslot *p = t->v + j;
+		if (!p->i || (p->h == h && !str_xcmp(a->v + p->i-1, fa, s, fs)))
+			return p;
+	}
+}
+
+/* Like sort_uniq() without the sorting: keeps the first of equal entries.
+ * If side is not NULL, a is the result of hash_join() on the children of e
+ * and a->v[i] comes from e->ch[side[i]]; then the entry the merge in
+ * tnode_eval() puts first is kept, as sort_uniq() keeps it there. */
+static void uniq_hash(
+	struct str_array *a, fieldmap_t fmap, const struct tnode *e,
+	unsigned char *side
+) {
+	struct htab t;
+	size_t i, j = 0;
+	htab_init(&t, a->valid);
+	for (i=0; i<a->valid; i++) {
+		struct str s = a->v[i];
+		if (!(fmap & str_fields(&s)))
+			continue;
+		uint64_t h = str_hash(&s, fmap);
+		struct hslot *p = htab_find(&t, a, fmap, &s, fmap, h);
+		if (p->i) {
+			size_t k = p->i-1;
+			if (side && str_xcmp(&s, e->ch[side[i]]->fields,
+			                     a->v + k, e->ch[side[k]]->fields) < 0) {
+				a->v[k] = s;
+				side[k] = side[i];
+			}
+			continue;
+		}
+		if (side)
+			side[j] = side[i];
+		a->v[j] = s;
+		p->i = ++j;
+		p->h = h;
+	}
+	a->valid = j;
+	htab_fini(&t);
+}
+
+void str_semijoin(
+	struct str_array *u, const struct str_array *a, fieldmap_t fa,
+	const struct str_array *keys, fieldmap_t fk
+) {
+	struct htab t;
+	size_t i;
+	htab_init(&t, keys->valid);
+	for (i=0; i<keys->valid; i++) {
+		uint64_t h = str_hash(keys->v+i, fk);
+		struct hslot *p = htab_find(&t, keys, fk, keys->v+i, fk, h);
+		if (!p->i) {
+			p->i = i + 1;
+			p->h = h;
+		}
+	}
+	for (i=0; i<a->valid; i++) {
+		const struct str *s = a->v + i;
+		if ((fa & str_fields(s)) &&
+		    htab_find(&t, keys, fk, s, fa, str_hash(s, fa))->i)
+			varr_append(u,s,1,1);
+	}
+	htab_fini(&t);
+}
+
+/* Builds a table on the smaller of l and r and probes it with the other.
+ * The child each entry of u comes from is stored in side. */
+static void hash_join(
+	struct str_array *u, unsigned char *side, const struct tnode *e,
+	const struct str_array *l, const struct str_array *r
+) {
+	int build_l = l->valid <= r->valid;
+	const struct str_array *b = build_l ? l : r, *q = build_l ? r : l;
+	fieldmap_t fb = e->ch[!build_l]->fields, fq = e->ch[build_l]->fields;
+	int left_first = e->ch[0]->id < e->ch[1]->id;
+	struct htab t;
+	char *matched;
+	size_t i;
+
+	htab_init(&t, b->valid);
+	for (i=0; i<b->valid; i++) {
+		uint64_t h = str_hash(b->v+i, fb);
+		struct hslot *p = htab_find(&t, b, fb, b->v+i, fb, h);
+		if (!p->i) {
+			p->i = i + 1;
+			p->h = h;
+		}
+	}
+
+	matched = ck_calloc(b->valid, 1);
+	for (i=0; i<q->valid; i++) {
+		const struct str *s = q->v + i, *pl, *pr;
+		struct hslot *p = htab_find(&t, b, fb, s, fq, str_hash(s, fq));
+		/* Pair entries one-to-one like the merge in tnode_eval() does.
+		 * Entries lacking some fields can equal several of the other
+		 * side or none the merge would reach, see option '-u'. */
+		int found = p->i && !matched[p->i-1];
+		if (found) {
+			matched[p->i-1] = 1;
+			pl = build_l ? b->v + p->i-1 : s;
+			pr = build_l ? s : b->v + p->i-1;
+		}
+		switch (e->type) {
+		case TNODE_ID:
+			break;
+		case TNODE_UNION:
+		case TNODE_INTERS:
+			if (found) {
+				side[u->valid] = !left_first;
+				varr_append(u,left_first ? pl : pr,1,1);
+			} else if (e->type == TNODE_UNION) {
+				side[u->valid] = build_l;
+				varr_append(u,s,1,1);
+			}
+			break;
+		case TNODE_DIFF:
+			if (build_l)
+				break;
+			/* fall through */
+		case TNODE_SYMDIFF:
+			if (!found) {
+				side[u->valid] = build_l;
+				varr_append(u,s,1,1);
+			}
+			break;
+		}
+	}
+	if (e->type != TNODE_INTERS && (e->type != TNODE_DIFF || build_l))
+		for (i=0; i<b->valid; i++)
+			if (!matched[i]) {
+				side[u->valid] = !build_l;
+				varr_append(u,b->v+i,1,1);
+			}
+	free(matched);
+	htab_fini(&t);
+}
+
+/* Evaluates the flattened e on the results r[0:e->n] of its children, which
+ * all are uniq wrt. e->fields, by counting the children each entry occurs in.
+ * Of equal entries the one tnode_merge_n() takes is kept. */
+static void hash_merge_n(
+	struct str_array *u, const struct tnode *e, const struct str_array *r
+) {
+	fieldmap_t f = e->fields;
+	unsigned *cnt, i;
+	int *id;
+	size_t n = 0, k;
+	struct htab t;
+
+	for (i=0; i<e->n; i++)
+		n += r[i].valid;
+	htab_init(&t, n);
+	varr_ensure_sz(u,n,0);
+	cnt = ck_calloc(n, sizeof(*cnt));
+	id = ck_calloc(n, sizeof(*id));
+	for (i=0; i<e->n; i++) {
+		const struct str_array *b = r + i;
+		int bid = e->ch[i]->id;
+		for (k=0; k<b->valid; k++) {
+			const struct str *s = b->v + k;
+			uint64_t h = str_hash(s, f);
+			struct hslot *p = htab_find(&t, u, f, s, f, h);
+			if (!p->i) {
+				varr_append(u,s,1,1);
+				p->i = u->valid;
+				p->h = h;
+				id[p->i-1] = bid;
+			} else if (e->type == TNODE_SYMDIFF ||
+			           bid <= id[p->i-1]) {
+				u->v[p->i-1] = *s;
+				id[p->i-1] = bid;
+			}
+			cnt[p->i-1]++;
+		}
+	}
+	for (k=0, n=0; k<u->valid; k++)
+		if (e->type == TNODE_UNION ||
+		    (e->type == TNODE_INTERS && cnt[k] == e->n) ||
+		    (e->type == TNODE_SYMDIFF && cnt[k] % 2))
+			u->v[n++] = u->v[k];
+	u->valid = n;
+	free(id);
+	free(cnt);
+	htab_fini(&t);
+}
+
+struct str_array tnode_eval_hash(
+	const struct tnode *e, const struct str_array *a, struct pool *p
+) {
+	struct str_array u = VARR_INIT, *ch;
+	unsigned char *side = NULL;
+	unsigned i;
+	if (e->type == TNODE_ID) {
+		varr_append_a(&u,a+e->id,0);
+		uniq_hash(&u,e->fields,NULL,NULL);
+		return u;
+	}
+	ch = ck_malloc(e->n * sizeof(*ch));
+	tnode_eval_children(e, a, p, tnode_eval_hash, ch);
+	if (e->n > 2) {
+		hash_merge_n(&u, e, ch);
+	} else {
+		side = ck_malloc(ch[0].valid + ch[1].valid + 1);
+		hash_join(&u, side, e, ch, ch + 1);
+	}
+	for (i=0; i<e->n; i++)
+		varr_fini(ch + i);
+	free(ch);
+	/* entries unique wrt. the children's fields are unique wrt. the same */
+	if (e->ch[0]->fields != e->fields || e->ch[1]->fields != e->fields)
+		uniq_hash(&u,e->fields,e,side);
+	free(side);
+	return u;
+}
@@ -1,5 +1,8 @@
 
+#include <pthread.h>
+
 #include "tnode.h"
+#include "pool.h"
 
 struct var {
 	char id;
@@ -160,12 +163,31 @@ void fnode_tree_free(struct fnode *r)
 
 
 
+/* result of a subexpression shared by multiple nodes */
+struct tnode_memo {
+	struct task t;		/* evaluates e */
+	pthread_mutex_t mtx;
+	unsigned nodes;		/* sharing this memo */
+	unsigned uses;		/* fetches of r left */
+	unsigned depth;		/* of nested memos, including this one */
+	tnode_eval_f *eval;
+	const struct tnode *e;
+	const struct str_array *a;
+	struct pool *p;
+	struct str_array r;
+};
+
 void tnode_tree_free(struct tnode *t)
 {
 	if (!t)
 		return;
-	tnode_tree_free(t->ch[0]);
-	tnode_tree_free(t->ch[1]);
+	for (unsigned i=0; i<t->n; i++)
+		tnode_tree_free(t->ch[i]);
+	if (t->memo && !--t->memo->nodes) {
+		pthread_mutex_destroy(&t->memo->mtx);
+		varr_fini(&t->memo->r);
+		free(t->memo);
+	}
 	free(t);
 }
 
@@ -184,20 +206,281 @@ void tnode_dump(FILE *f, const struct tnode *e)
 		fprintf(f, "%c", MIN_ID + e->id);
 	else {
 		fprintf(f, "%c(", ss[e->type]);
-		tnode_dump(f, e->ch[0]);
-		fprintf(f, ",");
-		tnode_dump(f, e->ch[1]);
+		for (unsigned i=0; i<e->n; i++) {
+			if (i)
+				fprintf(f, ",");
+			tnode_dump(f, e->ch[i]);
+		}
 		fprintf(f, ")");
 	}
 	fprintf(f, "[0x%08x]", e->fields);
 }
 
+static int tnode_is_assoc(const struct tnode *e)
+{
+	return e->type == TNODE_UNION || e->type == TNODE_INTERS ||
+	       e->type == TNODE_SYMDIFF;
+}
+
+/* whether all children of e share its fields */
+static int tnode_is_uniform(const struct tnode *e)
+{
+	for (unsigned i=0; i<e->n; i++)
+		if (e->ch[i]->fields != e->fields)
+			return 0;
+	return 1;
+}
+
+/* Whether the operands of child i can be taken over by the uniform e, whose
+ * children have been flattened already. Which operand of a chain of '^' an
+ * entry comes from depends on the nesting, so only the left-associative one
+ * the parser builds is merged, see tnode_merge_n(). */
+static int tnode_splices(const struct tnode *e, unsigned i)
+{
+	const struct tnode *c = e->ch[i];
+	return c->type == e->type && tnode_is_uniform(c) &&
+	       (e->type != TNODE_SYMDIFF || !i);
+}
+
+struct tnode * tnode_flatten(struct tnode *e)
+{
+	unsigned i, j, n = 0;
+	for (i=0; i<e->n; i++)
+		e->ch[i] = tnode_flatten(e->ch[i]);
+	if (!tnode_is_assoc(e) || !tnode_is_uniform(e))
+		return e;
+	for (i=0; i<e->n; i++)
+		n += tnode_splices(e, i) ? e->ch[i]->n : 1;
+	if (n == e->n)
+		return e;
+	struct tnode *r = malloc(sizeof(*r) + n * sizeof(*r->ch));
+	*r = *e;
+	r->n = 0;
+	for (i=0; i<e->n; i++) {
+		struct tnode *c = e->ch[i];
+		if (!tnode_splices(e, i)) {
+			r->ch[r->n++] = c;
+			continue;
+		}
+		for (j=0; j<c->n; j++)
+			r->ch[r->n++] = c->ch[j];
+		free(c);
+	}
+	free(e);
+	return r;
+}
+
+/* upper bound on the number of entries of e's result on the inputs a */
+static size_t tnode_card(const struct tnode *e, const struct str_array *a)
+{
+	size_t r = 0;
+	unsigned i;
+	switch (e->type) {
+	case TNODE_ID:
+		return a[e->id].valid;
+	case TNODE_UNION:
+	case TNODE_SYMDIFF:
+		for (i=0; i<e->n; i++)
+			r += tnode_card(e->ch[i], a);
+		return r;
+	case TNODE_INTERS:
+		for (i=0, r=SIZE_MAX; i<e->n; i++)
+			r = MIN(r, tnode_card(e->ch[i], a));
+		return r;
+	case TNODE_DIFF:
+		return tnode_card(e->ch[0], a);
+	}
+	return r;
+}
+
+/* Replaces e by its child i, the others are freed. This is only correct if
+ * the result of e equals that of the child, or if both are empty. */
+static struct tnode * tnode_replace(struct tnode *e, unsigned i)
+{
+	struct tnode *c = e->ch[i];
+	for (unsigned j=0; j<e->n; j++)
+		if (j != i)
+			tnode_tree_free(e->ch[j]);
+	c->fields = e->fields;
+	free(e);
+	return c;
+}
+
+/* Whether the child i alone yields the same as e if the others are empty.
+ * The ids must agree as they decide ties in the parent of e. */
+static int tnode_can_replace(const struct tnode *e, unsigned i)
+{
+	return e->ch[i]->fields == e->fields && e->ch[i]->id == e->id;
+}
+
+/* whether e->id stays the same without child i */
+static int tnode_keeps_id(const struct tnode *e, unsigned i)
+{
+	if (e->ch[i]->id != e->id)
+		return 1;
+	for (unsigned j=0; j<e->n; j++)
+		if (j != i && e->ch[j]->id == e->id)
+			return 1;
+	return 0;
+}
+
+/* X - (Y1 | ... | Yn) = (...(X - Y1) - ...) - Yn if the union is uniform; no
+ * union needs to be built and each Yi, largest first, is compared with what
+ * is left of the smaller X */
+static struct tnode * tnode_push_diff(struct tnode *e, const struct str_array *a)
+{
+	struct tnode *x = e->ch[0], *u = e->ch[1];
+	unsigned i, j;
+	if (u->type != TNODE_UNION || !tnode_is_uniform(u) ||
+	    tnode_card(x, a) >= tnode_card(u, a))
+		return e;
+	for (i=1; i<u->n; i++) {
+		struct tnode *c = u->ch[i];
+		size_t cc = tnode_card(c, a);
+		for (j=i; j && tnode_card(u->ch[j-1], a) < cc; j--)
+			u->ch[j] = u->ch[j-1];
+		u->ch[j] = c;
+	}
+	for (i=0; i<u->n; i++) {
+		x = tnode_create(TNODE_DIFF, x, u->ch[i]);
+		x->fields = x->ch[0]->fields;
+	}
+	x->fields = e->fields;
+	free(u);
+	free(e);
+	return x;
+}
+
+/* orders the operands of commutative e by increasing size; those of a
+ * flattened '^' decide its ties by their order, see tnode_merge_n() */
+static void tnode_order(struct tnode *e, const struct str_array *a)
+{
+	unsigned i, j;
+	if (!tnode_is_assoc(e) || (e->n > 2 && e->type == TNODE_SYMDIFF))
+		return;
+	if (e->n == 2) {
+		/* the tie-breaking of binary nodes depends on distinct ids */
+		if (e->ch[0]->id != e->ch[1]->id &&
+		    tnode_card(e->ch[1], a) < tnode_card(e->ch[0], a)) {
+			struct tnode *t = e->ch[0];
+			e->ch[0] = e->ch[1];
+			e->ch[1] = t;
+		}
+		return;
+	}
+	/* children of the same id stay in order, which decides their ties */
+	for (i=1; i<e->n; i++) {
+		struct tnode *c = e->ch[i];
+		size_t cc = tnode_card(c, a);
+		for (j=i; j && tnode_card(e->ch[j-1], a) > cc &&
+		          e->ch[j-1]->id != c->id; j--)
+			e->ch[j] = e->ch[j-1];
+		e->ch[j] = c;
+	}
+}
+
+struct tnode * tnode_optimize(struct tnode *e, const struct str_array *a)
+{
+	unsigned i, j;
+	for (i=0; i<e->n; i++)
+		e->ch[i] = tnode_optimize(e->ch[i], a);
+	switch (e->type) {
+	case TNODE_ID:
+		return e;
+	case TNODE_INTERS:
+		for (i=0; i<e->n; i++)
+			if (!tnode_card(e->ch[i], a))
+				return tnode_replace(e, i);
+		break;
+	case TNODE_DIFF:
+		if (!tnode_card(e->ch[0], a) ||
+		    (!tnode_card(e->ch[1], a) && tnode_can_replace(e, 0)))
+			return tnode_replace(e, 0);
+		return tnode_push_diff(e, a);
+	case TNODE_UNION:
+	case TNODE_SYMDIFF:
+		if (!tnode_card(e, a))
+			return tnode_replace(e, 0);
+		for (i=e->n; i--;) {
+			if (tnode_card(e->ch[i], a))
+				continue;
+			if (e->n == 2)
+				return tnode_can_replace(e, !i) ? tnode_replace(e, !i) : e;
+			if (!tnode_keeps_id(e, i))
+				continue;
+			tnode_tree_free(e->ch[i]);
+			for (j=i+1; j<e->n; j++)
+				e->ch[j-1] = e->ch[j];
+			e->n--;
+		}
+		break;
+	}
+	tnode_order(e, a);
+	return e;
+}
+
+VARR_DECL(tnode_parr,struct tnode *);
+
+static const void * tnode_class(const struct tnode *e)
+{
+	return e->memo ? (const void *)e->memo : e;
+}
+
+static int tnode_same(const struct tnode *a, const struct tnode *b)
+{
+	if (a->type != b->type || a->fields != b->fields || a->n != b->n ||
+	    (a->type == TNODE_ID && a->id != b->id))
+		return 0;
+	for (unsigned i=0; i<a->n; i++)
+		if (tnode_class(a->ch[i]) != tnode_class(b->ch[i]))
+			return 0;
+	return 1;
+}
+
+/* bottom-up, so equal subtrees have children of the same class */
+static void tnode_share_rec(struct tnode *e, struct tnode_parr *seen)
+{
+	struct tnode **f;
+	for (unsigned i=0; i<e->n; i++)
+		tnode_share_rec(e->ch[i], seen);
+	varr_forall(f,seen)
+		if (tnode_same(*f, e)) {
+			if (!(*f)->memo) {
+				(*f)->memo = ck_calloc(1, sizeof(*(*f)->memo));
+				pthread_mutex_init(&(*f)->memo->mtx, NULL);
+				(*f)->memo->nodes = 1;
+			}
+			e->memo = (*f)->memo;
+			e->memo->nodes++;
+			return;
+		}
+	varr_append(seen,&e,1,1);
+}
+
+/* counts the fetches of each memo by the nodes actually evaluated */
+static void tnode_count_uses(const struct tnode *e)
+{
+	for (unsigned i=0; i<e->n; i++) {
+		const struct tnode *c = e->ch[i];
+		if (!c->memo || !c->memo->uses++)
+			tnode_count_uses(c);
+	}
+}
+
+void tnode_share(struct tnode *e)
+{
+	struct tnode_parr seen = VARR_INIT;
+	tnode_share_rec(e, &seen);
+	tnode_count_uses(e);
+	varr_fini(&seen);
+}
+
 
 static int str_fcmp(
 	const struct str *pa, unsigned fia,
 	const struct str *pb, unsigned fib
 ) {
-	struct field fa = pa->f[fia], fb = pb->f[fib];
+	struct field fa = str_field(pa, fia), fb = str_field(pb, fib);
 	int d = memcmp(pa->s + fa.from, pb->s + fb.from, MIN(fa.len, fb.len));
 #if DEBUG
 	fprintf(stderr, "cmp %d '%.*s' vs %d '%.*s' -> %d\n",
@@ -212,7 +495,8 @@ static int str_ycmp(
 	const struct str *pa, const struct str *pb, fieldmap_t fmap
 ) {
 	unsigned a = 0;
-	fieldmap_t fm = fmap & ~(~(fieldmap_t)0 << MIN(pa->n, pb->n));
+	fieldmap_t common = str_fields(pa) & str_fields(pb);
+	fieldmap_t fm = fmap & common;
 	while (fm) {
 		while (!(fm & 1))
 			fm >>= 1, a++;
@@ -221,18 +505,18 @@ static int str_ycmp(
 			return d;
 		fm >>= 1, a++;
 	}
-	return fmap & (~(fieldmap_t)0 << MIN(pa->n,pb->n)) ? pa->n - pb->n : 0;
+	return fmap & ~common ? pa->n - pb->n : 0;
 }
 
-static int str_xcmp(
+int str_xcmp(
 	const struct str *pa, fieldmap_t fmap,
 	const struct str *pb, fieldmap_t fmbp
 ) {
 	if (fmap == fmbp)
 		return str_ycmp(pa, pb, fmap);
 	unsigned a = 0, b = 0;
-	fieldmap_t fma = fmap & ~(~(fieldmap_t)0 << pa->n);
-	fieldmap_t fmb = fmbp & ~(~(fieldmap_t)0 << pb->n);
+	fieldmap_t fma = fmap & str_fields(pa);
+	fieldmap_t fmb = fmbp & str_fields(pb);
 	unsigned m = 0;
 	while (fma && fmb) {
 		while (!(fma & 1)) fma >>= 1, a++;
@@ -247,39 +531,659 @@ static int str_xcmp(
 	return fma ? -1 : fmb ? +1 : 0;
 }
 
-static fieldmap_t sort_uniq_fields;
+/* smallest field >= i in fmap or MAX_FIELD+1 if there is none */
+static unsigned fieldmap_next(fieldmap_t fmap, unsigned i)
+{
+	while (i <= MAX_FIELD && !(fmap & ((fieldmap_t)1 << i)))
+		i++;
+	return i;
+}
+
+#ifdef SETOP_SORT_QSORT
+
+/* qsort() passes no context to the comparison and is not stable, so every
+ * entry carries the fields it is sorted by and its position */
+struct str_qent {
+	struct str s;
+	fieldmap_t fmap;
+	size_t i;
+};
 
 static int str_qcmp(const void *a, const void *b)
 {
-	const struct str *pa = a, *pb = b;
-	return str_ycmp(pa, pb, sort_uniq_fields);
+	const struct str_qent *pa = a, *pb = b;
+	int d = str_ycmp(&pa->s, &pb->s, pa->fmap);
+	return d ? d : pa->i < pb->i ? -1 : +1;
+}
+
+#else
+
+#define MKQ_CUTOFF	12
+
+/* Arrays at least this large are presorted by the normalized key prefixes of
+ * their entries, so most comparisons are done on integers held in a separate
+ * array instead of chasing each entry's fields and chars. */
+#define PREFIX_SORT_MIN	64
+
+struct str_key {
+	uint64_t k;	/* str_prefix() */
+	size_t i;	/* index of the entry */
+};
+
+/* Symbol at position d of field i of s for the multikey quicksort. It orders
+ * like str_ycmp(): field bytes map to 1..256, the end of the field to 0 and
+ * a missing field to a negative value increasing with s->n. */
+static inline int str_sym(const struct str *s, unsigned i, size_t d)
+{
+	if (i >= s->n)
+		return (int)s->n - 2 * (MAX_FIELD+1);
+	struct field f = str_field(s, i);
+	return d < f.len ? 1 + (unsigned char)s->s[f.from + d] : 0;
+}
+
+/* swaps entries i and j of a and of the keys p going along with them */
+static inline void str_swap(struct str *a, struct str_key *p, size_t i, size_t j)
+{
+	struct str t = a[i];
+	struct str_key u = p[i];
+	a[i] = a[j];
+	a[j] = t;
+	p[i] = p[j];
+	p[j] = u;
+}
+
+static void str_vecswap(struct str *a, struct str_key *p, size_t i, size_t j, size_t n)
+{
+	while (n--)
+		str_swap(a, p, i++, j++);
+}
+
+static size_t str_med3(
+	const struct str *a, size_t x, size_t y, size_t z, unsigned i, size_t d
+) {
+	int va = str_sym(a + x, i, d), vb = str_sym(a + y, i, d), vc = str_sym(a + z, i, d);
+	if (va == vb)
+		return x;
+	if (vc == va || vc == vb)
+		return z;
+	return va < vb ? (vb < vc ? y : va < vc ? z : x)
+	               : (vb > vc ? y : va < vc ? x : z);
+}
+
+/* Bentley-Sedgewick multikey quicksort of a[0:n] wrt. fmap, all of whose
+ * entries are known to agree on the fields before i and on the first d chars
+ * of field i. p[0:n] holds the positions of the entries before sorting and is
+ * permuted along with them; of equal entries the one of the least position
+ * ends up first. */
+static void str_mkqsort(
+	struct str *a, struct str_key *p, size_t n, fieldmap_t fmap, unsigned i,
+	size_t d
+) {
+	size_t j, k;
+	while (n > MKQ_CUTOFF) {
+		str_swap(a, p, 0, str_med3(a, 0, n/2, n-1, i, d));
+		int v = str_sym(a, i, d), r;
+		size_t le = 1, lt = 1, gt = n-1, ge = n-1;
+		for (;;) {
+			for (; lt <= gt && (r = str_sym(a + lt, i, d) - v) <= 0; lt++)
+				if (!r)
+					str_swap(a, p, le++, lt);
+			for (; lt <= gt && (r = str_sym(a + gt, i, d) - v) >= 0; gt--)
+				if (!r)
+					str_swap(a, p, gt, ge--);
+			if (lt > gt)
+				break;
+			str_swap(a, p, lt++, gt--);
+		}
+		size_t nlt = lt - le, ngt = ge - gt;
+		str_vecswap(a, p, 0, lt - MIN(le, nlt), MIN(le, nlt));
+		str_vecswap(a, p, lt, n - MIN(ngt, n-1-ge), MIN(ngt, n-1-ge));
+		str_mkqsort(a, p, nlt, fmap, i, d);
+		str_mkqsort(a + n - ngt, p + n - ngt, ngt, fmap, i, d);
+		/* continue with the entries equal to the pivot */
+		a += nlt;
+		p += nlt;
+		n -= nlt + ngt;
+		if (v > 0)
+			d++;
+		else if (!v && (i = fieldmap_next(fmap, i+1)) <= MAX_FIELD)
+			d = 0;
+		else {
+			/* all are equal, only the first one matters */
+			for (j=1, k=0; j<n; j++)
+				if (p[j].i < p[k].i)
+					k = j;
+			str_swap(a, p, 0, k);
+			return;
+		}
+	}
+	for (j=1; j<n; j++)
+		for (k=j; k; k--) {
+			int c = str_ycmp(a + k-1, a + k, fmap);
+			if (c < 0 || (!c && p[k-1].i < p[k].i))
+				break;
+			str_swap(a, p, k-1, k);
+		}
+}
+
+/* The first 8 chars of field i of s in big-endian order, padded with zeros.
+ * A smaller prefix means s is smaller wrt. str_ycmp() on fields starting
+ * with i, equal prefixes mean nothing. Entries without field i get 0, which
+ * is not larger than any other prefix. */
+static uint64_t str_prefix(const struct str *s, unsigned i)
+{
+	uint64_t k = 0;
+	if (i >= s->n)
+		return 0;
+	struct field f = str_field(s, i);
+	const unsigned char *c = (const unsigned char *)s->s + f.from;
+	for (unsigned j=0; j<8; j++)
+		k = k << 8 | (j < f.len ? c[j] : 0);
+	return k;
+}
+
+/* number of leading chars of field i all of v[0:n] share, given they have the
+ * same prefix */
+static size_t str_prefix_len(const struct str *v, size_t n, unsigned i)
+{
+	size_t d = 8;
+	for (size_t j=0; j<n && d; j++)
+		d = v[j].n <= i ? 0 : MIN(d, str_field(v + j, i).len);
+	return d;
+}
+
+/* stable LSD radix sort of a[0:n] by k using tmp[0:n], skipping the bytes
+ * all keys agree on */
+static void str_key_sort(struct str_key *a, struct str_key *tmp, size_t n)
+{
+	size_t cnt[8][256] = {{0}}, i;
+	struct str_key *in = a, *t;
+	unsigned b, c;
+	for (i=0; i<n; i++)
+		for (b=0; b<8; b++)
+			cnt[b][a[i].k >> 8*b & 0xff]++;
+	for (b=0; b<8; b++) {
+		size_t *h = cnt[b], off = 0;
+		if (h[in->k >> 8*b & 0xff] == n)
+			continue;
+		for (c=0; c<256; c++) {
+			size_t m = h[c];
+			h[c] = off;
+			off += m;
+		}
+		for (i=0; i<n; i++)
+			tmp[h[in[i].k >> 8*b & 0xff]++] = in[i];
+		t = in;
+		in = tmp;
+		tmp = t;
+	}
+	if (in != a)
+		memcpy(a, in, n * sizeof(*a));
+}
+
+#endif
+
+/* sorts v[0:n] wrt. fmap; of equal entries the first one in v comes first,
+ * which is the one str_uniq() keeps */
+static void str_sort(struct str *v, size_t n, fieldmap_t fmap)
+{
+#ifdef SETOP_SORT_QSORT
+	struct str_qent *q = ck_malloc(n * sizeof(*q));
+	size_t i;
+	for (i=0; i<n; i++)
+		q[i] = (struct str_qent){ v[i], fmap, i };
+	qsort(q, n, sizeof(*q), str_qcmp);
+	for (i=0; i<n; i++)
+		v[i] = q[i].s;
+	free(q);
+#else
+	if (!fmap)
+		return;
+	unsigned f = fieldmap_next(fmap, 0);
+	if (n < PREFIX_SORT_MIN) {
+		struct str_key p[PREFIX_SORT_MIN];
+		for (size_t i=0; i<n; i++)
+			p[i] = (struct str_key){ 0, i };
+		str_mkqsort(v, p, n, fmap, f, 0);
+		return;
+	}
+	struct str_key *k = ck_malloc(2 * n * sizeof(*k));
+	struct str *t;
+	size_t i, j;
+	for (i=0; i<n; i++)
+		k[i] = (struct str_key){ str_prefix(v + i, f), i };
+	str_key_sort(k, k + n, n);
+	t = ck_malloc(n * sizeof(*t));
+	for (i=0; i<n; i++)
+		t[i] = v[k[i].i];
+	memcpy(v, t, n * sizeof(*v));
+	free(t);
+	/* only entries with equal prefixes need to be compared, the stable
+	 * presort left them in their original order */
+	for (i=0; i<n; i=j) {
+		for (j=i+1; j<n && k[j].k == k[i].k; j++);
+		if (j - i > 1)
+			str_mkqsort(v + i, k + i, j - i, fmap, f,
+			            str_prefix_len(v + i, j - i, f));
+	}
+	free(k);
+#endif
 }
 
-static void sort_uniq(struct str_array *a, fieldmap_t fmap)
+/* removes duplicates but the first of equal entries and entries not having
+ * any field in fmap from the sorted v[0:n], returns the number of entries
+ * left */
+static size_t str_uniq(struct str *v, size_t n, fieldmap_t fmap)
 {
-	sort_uniq_fields = fmap;
-	varr_qsort(a,str_qcmp);
-	unsigned i = 0;
-	while (i<a->valid && !(fmap & ~(~(fieldmap_t)0 << a->v[i].n)))
-		memmove(a->v+i, a->v+i+1, (--a->valid-i)*sizeof(*a->v));
-	for (i=1; i<a->valid; i++)
-		if (!(fmap & ~(~(fieldmap_t)0 << a->v[i].n)) || !str_qcmp(a->v+i-1, a->v+i)) {
+	size_t i, j = 0;
+	for (i=0; i<n; i++) {
+		if (!(fmap & str_fields(v+i)))
+			continue;
+		if (j && !str_ycmp(v+j-1, v+i, fmap)) {
 #if DEBUG
-			fprintf(stderr, "removing duplicate '%s' = '%s' wrt. 0x%08x\n", a->v[i-1].s, a->v[i].s, fmap);
+			fprintf(stderr, "removing duplicate '%s' = '%s' wrt. 0x%08x\n", v[j-1].s, v[i].s, fmap);
 #endif
-			memmove(a->v+i, a->v+i+1, (--a->valid-i)*sizeof(*a->v));
-			i--;
+			continue;
 		}
-	while (i<a->valid && !(fmap & ~(~(fieldmap_t)0 << a->v[i].n)))
-		memmove(a->v+i, a->v+i+1, (--a->valid-i)*sizeof(*a->v));
+		v[j++] = v[i];
+	}
+	return j;
+}
+
+/* Arrays at least this large are sorted in parallel if a pool is available:
+ * every thread sorts a chunk, the chunks are partitioned by splitters sampled
+ * from them and each thread merges and uniq's one part. */
+#define SORT_PAR_MIN		((size_t)1 << 16)
+#define SORT_PAR_SAMPLES	16	/* per chunk and part */
+
+struct str_run {
+	struct str *v;
+	size_t n;
+};
+
+struct sort_task {
+	struct task t;
+	fieldmap_t fmap;
+	unsigned k;		/* number of runs in in */
+	struct str_run *in;
+	struct str *out;	/* NULL: sort in[0] in place */
+	size_t n;		/* entries left in out after uniq */
+};
+
+/* equal entries are ordered by their runs, which keeps them in the order of
+ * the chunks they come from */
+static int str_run_less(const struct str_run *r, unsigned a, unsigned b, fieldmap_t fmap)
+{
+	int d = str_ycmp(r[a].v, r[b].v, fmap);
+	return d < 0 || (!d && a < b);
+}
+
+static void str_run_down(
+	unsigned *h, unsigned nh, unsigned i, const struct str_run *r,
+	fieldmap_t fmap
+) {
+	for (unsigned c; (c = 2*i+1) < nh; i = c) {
+		if (c+1 < nh && str_run_less(r, h[c+1], h[c], fmap))
+			c++;
+		if (!str_run_less(r, h[c], h[i], fmap))
+			break;
+		unsigned t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+	}
+}
+
+static void sort_task_run(struct task *t)
+{
+	struct sort_task *x = (struct sort_task *)t;
+	if (!x->out) {
+		str_sort(x->in->v, x->in->n, x->fmap);
+		return;
+	}
+	unsigned *h = ck_malloc(x->k * sizeof(*h)), nh = 0;
+	size_t j = 0;
+	for (unsigned i=0; i<x->k; i++)
+		if (x->in[i].n)
+			h[nh++] = i;
+	for (unsigned i=nh/2; i--;)
+		str_run_down(h, nh, i, x->in, x->fmap);
+	while (nh) {
+		struct str_run *r = x->in + h[0];
+		x->out[j++] = *r->v++;
+		if (!--r->n)
+			h[0] = h[--nh];
+		str_run_down(h, nh, 0, x->in, x->fmap);
+	}
+	free(h);
+	x->n = str_uniq(x->out, j, x->fmap);
+}
+
+/* runs x[0:k] on p and returns after all of them are done */
+static void sort_tasks_run(struct pool *p, struct sort_task *x, unsigned k)
+{
+	for (unsigned i=1; i<k; i++)
+		pool_spawn(p, &x[i].t);
+	sort_task_run(&x->t);
+	for (unsigned i=1; i<k; i++)
+		pool_join(p, &x[i].t);
+}
+
+/* index of the first entry in r not smaller than s */
+static size_t str_run_lower(const struct str_run *r, const struct str *s, fieldmap_t fmap)
+{
+	size_t lo = 0, hi = r->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (str_ycmp(r->v + mid, s, fmap) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void sort_uniq_par(struct str_array *a, fieldmap_t fmap, struct pool *p)
+{
+	unsigned k = pool_nthreads(p), ns = k * SORT_PAR_SAMPLES, i, m;
+	size_t n = a->valid, j;
+	struct str_run *chunk = ck_malloc(k * sizeof(*chunk));
+	struct str_run *part = ck_malloc(k * k * sizeof(*part));
+	struct sort_task *x = ck_calloc(k, sizeof(*x));
+	struct str *smp = ck_malloc(k * ns * sizeof(*smp));
+	struct str *out = ck_malloc(n * sizeof(*out));
+	size_t *off = ck_calloc(k, sizeof(*off));
+
+	for (i=0; i<k; i++) {
+		chunk[i].v = a->v + i * n / k;
+		chunk[i].n = (i+1) * n / k - i * n / k;
+		x[i] = (struct sort_task){ { sort_task_run, 0 }, fmap, 1, chunk + i, };
+	}
+	sort_tasks_run(p, x, k);
+
+	/* part m of chunk i holds the entries in [splitter m, splitter m+1) */
+	for (i=0; i<k; i++)
+		for (j=0; j<ns; j++)
+			smp[i*ns+j] = chunk[i].v[(2*j+1) * chunk[i].n / (2*ns)];
+	str_sort(smp, k * ns, fmap);
+	for (i=0; i<k; i++) {
+		size_t lo = 0, hi;
+		for (m=0; m<k; m++) {
+			hi = m+1 < k ? str_run_lower(chunk + i, smp + (m+1) * ns, fmap)
+			             : chunk[i].n;
+			part[m*k+i] = (struct str_run){ chunk[i].v + lo, hi - lo };
+			if (m+1 < k)
+				off[m+1] += hi;
+			lo = hi;
+		}
+	}
+
+	for (m=0; m<k; m++)
+		x[m] = (struct sort_task){ { sort_task_run, 0 }, fmap, k, part + m*k, out + off[m], };
+	sort_tasks_run(p, x, k);
+
+	for (m=0, j=0; m<k; j += x[m++].n)
+		memmove(out + j, out + off[m], x[m].n * sizeof(*out));
+	free(a->v);
+	a->v = out;
+	a->n = n;
+	a->valid = j;
+
+	free(off);
+	free(smp);
+	free(x);
+	free(part);
+	free(chunk);
+}
+
+void uniq(struct str_array *a, fieldmap_t fmap)
+{
+	a->valid = str_uniq(a->v, a->valid, fmap);
+}
+
+/* whether v[0:n] is sorted wrt. fmap apart from entries not having any of
+ * these fields; stops at the first descent, so unsorted input costs little */
+static int str_is_sorted(const struct str *v, size_t n, fieldmap_t fmap)
+{
+	const struct str *prev = NULL;
+	for (size_t i=0; i<n; i++) {
+		if (!(fmap & str_fields(v+i)))
+			continue;
+		if (prev && str_ycmp(prev, v+i, fmap) > 0)
+			return 0;
+		prev = v + i;
+	}
+	return 1;
 }
 
-struct str_array tnode_eval(const struct tnode *e, const struct str_array *a)
+void sort_uniq(struct str_array *a, fieldmap_t fmap, struct pool *p)
 {
+	/* e.g. inputs loaded from an index */
+	if (str_is_sorted(a->v, a->valid, fmap)) {
+		uniq(a, fmap);
+		return;
+	}
+	if (p && pool_nthreads(p) > 1 && fmap && a->valid >= SORT_PAR_MIN) {
+		sort_uniq_par(a, fmap, p);
+		return;
+	}
+	str_sort(a->v, a->valid, fmap);
+	a->valid = str_uniq(a->v, a->valid, fmap);
+}
+
+struct eval_task {
+	struct task t;
+	tnode_eval_f *eval;
+	const struct tnode *e;
+	const struct str_array *a;
+	struct pool *p;
+	struct str_array r;
+};
+
+static void memo_task_run(struct task *t)
+{
+	struct tnode_memo *m = (struct tnode_memo *)t;
+	m->r = m->eval(m->e, m->a, m->p);
+}
+
+/* Evaluates e, or fetches its result from e->memo computed before by
+ * tnode_eval_shared(). All but the last fetch get a copy. */
+static struct str_array tnode_eval_child(
+	const struct tnode *e, const struct str_array *a, struct pool *p,
+	tnode_eval_f *eval
+) {
+	struct tnode_memo *m = e->memo;
+	struct str_array r = VARR_INIT;
+	if (!m)
+		return eval(e, a, p);
+	pthread_mutex_lock(&m->mtx);
+	if (--m->uses) {
+		if (m->r.valid)
+			varr_append_a(&r,&m->r,0);
+	} else {
+		r = m->r;
+		m->r = (struct str_array)VARR_INIT;
+	}
+	pthread_mutex_unlock(&m->mtx);
+	return r;
+}
+
+VARR_DECL(memo_parr,struct tnode_memo *);
+
+/* appends the memos fetched when evaluating e to v, each after the ones it
+ * fetches itself, and returns their maximum depth */
+static unsigned tnode_collect_memos(const struct tnode *e, struct memo_parr *v)
+{
+	struct tnode_memo *m = e->memo;
+	unsigned d = 0;
+	if (m && m->e)
+		return m->depth;
+	for (unsigned i=0; i<e->n; i++)
+		d = MAX(d, tnode_collect_memos(e->ch[i], v));
+	if (m) {
+		m->e = e;
+		m->depth = ++d;
+		varr_append(v,&m,1,1);
+	}
+	return d;
+}
+
+void tnode_eval_shared(
+	const struct tnode *e, const struct str_array *a, struct pool *p,
+	tnode_eval_f *eval
+) {
+	struct memo_parr v = VARR_INIT;
+	struct tnode_memo **m;
+	int par = p && pool_nthreads(p) > 1;
+	unsigned depth = tnode_collect_memos(e, &v);
+	/* Memos only fetch ones of lower depth. Evaluating them level by level
+	 * no thread ever waits for a memo, which could be in progress further
+	 * down its own stack when it ran other tasks while joining. */
+	for (unsigned d=1; d<=depth; d++) {
+		varr_forall(m,&v)
+			if ((*m)->depth == d) {
+				(*m)->t.run = memo_task_run;
+				(*m)->eval = eval;
+				(*m)->a = a;
+				(*m)->p = p;
+				if (par)
+					pool_spawn(p, &(*m)->t);
+				else
+					memo_task_run(&(*m)->t);
+			}
+		if (par)
+			varr_forall(m,&v)
+				if ((*m)->depth == d)
+					pool_join(p, &(*m)->t);
+	}
+	varr_fini(&v);
+}
+
+static void eval_task_run(struct task *t)
+{
+	struct eval_task *x = (struct eval_task *)t;
+	x->r = tnode_eval_child(x->e, x->a, x->p, x->eval);
+}
+
+void tnode_eval_children(
+	const struct tnode *e, const struct str_array *a, struct pool *p,
+	tnode_eval_f *eval, struct str_array *r
+) {
+	unsigned i;
+	if (!p || pool_nthreads(p) < 2 || e->n < 2) {
+		for (i=0; i<e->n; i++)
+			r[i] = tnode_eval_child(e->ch[i], a, p, eval);
+		return;
+	}
+	struct eval_task *x = ck_calloc(e->n, sizeof(*x));
+	for (i=1; i<e->n; i++) {
+		x[i] = (struct eval_task){ { eval_task_run, 0 }, eval, e->ch[i], a, p, };
+		pool_spawn(p, &x[i].t);
+	}
+	r[0] = tnode_eval_child(e->ch[0], a, p, eval);
+	for (i=1; i<e->n; i++) {
+		pool_join(p, &x[i].t);
+		r[i] = x[i].r;
+	}
+	free(x);
+}
+
+static void str_run_up(
+	unsigned *h, unsigned i, const struct str_run *r, fieldmap_t fmap
+) {
+	for (unsigned c; i && str_run_less(r, h[i], h[c = (i-1)/2], fmap); i = c) {
+		unsigned t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+	}
+}
+
+/* k-way merge of the results r[0:e->n] of e's children, which all are sorted
+ * and uniq'd wrt. e->fields, taking of equal entries the one the binary nodes
+ * nested left-associatively would: for '^' that of the last child, otherwise
+ * that of the child with the lowest id and of several such the last one. The
+ * latter is also what any other nesting yields, as children of equal ids
+ * yield the same entries in a uniform tree. */
+static void tnode_merge_n(
+	struct str_array *u, const struct tnode *e, const struct str_array *r
+) {
+	unsigned k = e->n, nh = 0, ne, i, j;
+	unsigned *h = ck_malloc(2 * k * sizeof(*h)), *eq = h + k;
+	struct str_run *in = ck_malloc(k * sizeof(*in));
+	fieldmap_t f = e->fields;
+
+	for (i=0; i<k; i++)
+		if ((in[i] = (struct str_run){ r[i].v, r[i].valid }).n)
+			h[nh++] = i;
+	for (i=nh/2; i--;)
+		str_run_down(h, nh, i, in, f);
+	/* an intersection is done as soon as one child is */
+	while (nh && (e->type != TNODE_INTERS || nh == k)) {
+		const struct str *m = in[h[0]].v;
+		unsigned best = h[0];
+		ne = 0;
+		do {
+			i = eq[ne++] = h[0];
+			if (e->type == TNODE_SYMDIFF ? i > best :
+			    e->ch[i]->id < e->ch[best]->id ||
+			    (e->ch[i]->id == e->ch[best]->id && i > best))
+				best = i;
+			h[0] = h[--nh];
+			str_run_down(h, nh, 0, in, f);
+		} while (nh && !str_ycmp(in[h[0]].v, m, f));
+		if (e->type == TNODE_UNION ||
+		    (e->type == TNODE_INTERS && ne == k) ||
+		    (e->type == TNODE_SYMDIFF && ne % 2))
+			varr_append(u,in[best].v,1,1);
+		for (j=0; j<ne; j++) {
+			i = eq[j];
+			in[i].v++;
+			if (--in[i].n) {
+				h[nh] = i;
+				str_run_up(h, nh++, in, f);
+			}
+		}
+	}
+	free(in);
+	free(h);
+}
+
+/* An intersection or difference whose operand i is a leaf much larger than
+ * the other can filter the leaf by the other's entries before sorting it. */
+#define SEMIJOIN_RATIO	16
+
+/* returns the operand of e to filter this way or -1 */
+static int tnode_semijoin_side(const struct tnode *e, const struct str_array *a)
+{
+	if (e->n != 2 || (e->type != TNODE_INTERS && e->type != TNODE_DIFF))
+		return -1;
+	for (int i = e->type == TNODE_DIFF; i < 2; i++) {
+		const struct tnode *b = e->ch[i];
+		if (b->type == TNODE_ID && !b->memo &&
+		    a[b->id].valid / SEMIJOIN_RATIO >= tnode_card(e->ch[!i], a))
+			return i;
+	}
+	return -1;
+}
+
+struct str_array tnode_eval(
+	const struct tnode *e, const struct str_array *a, struct pool *p
+) {
 	struct str_array u = VARR_INIT;
 	if (e) {
-		const struct str_array l = tnode_eval(e->ch[0], a);
-		const struct str_array r = tnode_eval(e->ch[1], a);
+		struct str_array c[2] = { VARR_INIT, VARR_INIT };
+		struct str_array *ch = e->n > 2 ? ck_malloc(e->n * sizeof(*ch)) : c;
+		int big = tnode_semijoin_side(e, a);
+		if (big < 0) {
+			tnode_eval_children(e, a, p, tnode_eval, ch);
+		} else {
+			/* only the entries of the big leaf matching the small side
+			 * need sorting */
+			const struct tnode *b = e->ch[big], *t = e->ch[!big];
+			ch[!big] = tnode_eval_child(t, a, p, tnode_eval);
+			str_semijoin(ch + big, a + b->id, b->fields, ch + !big, t->fields);
+			sort_uniq(ch + big, b->fields, p);
+		}
+		struct str_array l = c[0], r = c[1];
 		const struct str *pl = l.v, *pr = r.v;
 #if DEBUG
 		for (unsigned i=0; i<l.valid; i++) {
@@ -292,7 +1196,12 @@ struct str_array tnode_eval(const struct tnode *e, const struct str_array *a)
 		}
 #endif
 		unsigned nl = 0, nr = 0;
-		switch (e->type) {
+		if (e->n > 2) {
+			tnode_merge_n(&u, e, ch);
+			for (unsigned i=0; i<e->n; i++)
+				varr_fini(ch + i);
+			free(ch);
+		} else switch (e->type) {
 		case TNODE_ID:
 #if DEBUG
 			for (unsigned i=0; i<a[e->id].valid; i++) {
@@ -355,7 +1264,15 @@ struct str_array tnode_eval(const struct tnode *e, const struct str_array *a)
 			fprintf(stderr, " u: '%s'\n", u.v[i].s);
 		}
 #endif
-		sort_uniq(&u,e->fields);
+		/* The result of each node is sorted and uniq'd wrt. its fields,
+		 * and merging mostly keeps that order. Only if this node projects
+		 * to other fields a re-sort may be necessary. */
+		fieldmap_t g;
+		if (e->type == TNODE_ID || !tnode_merge_order(e, &g) ||
+		    !fieldmap_is_prefix(e->fields, g))
+			sort_uniq(&u,e->fields,p);
+		else if (e->fields != g)
+			uniq(&u,e->fields);
 	}
 	return u;
 }
@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "common.h"
 #include "array.h"
 
@@ -14,12 +15,48 @@
 
 typedef unsigned fieldmap_t;
 
+struct field { unsigned from, len; };
+struct field16 { uint16_t from, len; };	/* for lines up to STR_NARROW_MAX */
+
+#define STR_NARROW_MAX	UINT16_MAX
+
 struct str {
 	char *s;
-	struct field { unsigned from, len; } *f;
+	void *f;	/* struct field[n], or struct field16[n] if narrow */
 	unsigned n;
+	unsigned narrow : 1;
 };
 
+static inline struct field str_field(const struct str *s, unsigned i)
+{
+	if (s->narrow) {
+		const struct field16 *f = s->f;
+		return (struct field){ f[i].from, f[i].len };
+	}
+	return ((const struct field *)s->f)[i];
+}
+
+/* size of the field table of s in chars */
+static inline size_t str_fsz(const struct str *s)
+{
+	return s->n * (s->narrow ? sizeof(struct field16) : sizeof(struct field));
+}
+
+/* number of chars of s->s covered by its fields */
+static inline size_t str_extent(const struct str *s)
+{
+	if (!s->n)
+		return 0;
+	struct field f = str_field(s, s->n-1);
+	return f.from + f.len;
+}
+
+/* fields present in s */
+static inline fieldmap_t str_fields(const struct str *s)
+{
+	return s->n > MAX_FIELD ? ~(fieldmap_t)0 : ~(~(fieldmap_t)0 << s->n);
+}
+
 VARR_DECL(str_array,struct str);
 VARR_DECL(src_array,struct str_array);
 
@@ -30,11 +67,18 @@ enum tnode_type {
 	TNODE_ID, TNODE_UNION, TNODE_INTERS, TNODE_DIFF, TNODE_SYMDIFF,
 };
 
+struct tnode_memo;
+
+/* Inner nodes have n == 2 children unless tnode_flatten() merged a chain of
+ * the associative operators |, & and ^ into one with more. Nodes sharing a
+ * memo are equal subexpressions, see tnode_share(). */
 struct tnode {
 	enum tnode_type type;
-	struct tnode *ch[2];
 	int id;
 	fieldmap_t fields;
+	struct tnode_memo *memo;
+	unsigned n;
+	struct tnode *ch[];
 };
 
 enum fnode_type {
@@ -61,6 +105,23 @@ struct fnode {
 
 void tnode_tree_free(struct tnode *t);
 void tnode_dump(FILE *f, const struct tnode *e);
+
+/* Merges chains of the same associative operator whose operands all share the
+ * chain's fields into single nodes, so these are evaluated by one k-way merge;
+ * chains of '^' only if nested left-associatively. Returns the new root; the
+ * nodes of e may have been reallocated. */
+struct tnode * tnode_flatten(struct tnode *e);
+
+/* Rewrites e for cheaper evaluation on the inputs a without changing its
+ * result: provably empty operands are short-circuited, commutative operands
+ * ordered smallest first and differences from unions split into chains of
+ * differences. Returns the new root; nodes of e may have been freed. */
+struct tnode * tnode_optimize(struct tnode *e, const struct str_array *a);
+
+/* Detects common subexpressions of e, e.g. leaves selecting the same fields
+ * of the same input, so each of them is evaluated only once, see
+ * tnode_eval_shared(). */
+void tnode_share(struct tnode *e);
 void fnode_tree_free(struct fnode *r);
 void fnode_tree_dump(FILE *f, const struct fnode *r);
 
@@ -126,13 +187,36 @@ static inline struct fnode * fnode_create_tuple(struct fnode_arr a)
 
 
 
+/* Whether f consists of the lowest fields of g. Then records sorted and
+ * uniq'd wrt. g are sorted wrt. f, too, and duplicates wrt. f are adjacent. */
+static inline int fieldmap_is_prefix(fieldmap_t f, fieldmap_t g)
+{
+	fieldmap_t rest = g & ~f;
+	return !(f & ~g) && !(f & ~((rest & -rest) - 1));
+}
+
+/* Whether merging the children of the inner node e yields entries sorted and
+ * uniq'd wrt. the fields stored in *g, which is the case if all children agree
+ * on them or for differences keeping a subsequence of the left child. */
+static inline int tnode_merge_order(const struct tnode *e, fieldmap_t *g)
+{
+	*g = e->ch[0]->fields;
+	return e->type == TNODE_DIFF || e->ch[1]->fields == *g;
+}
+
 static inline struct tnode * tnode_create(
 	enum tnode_type type, struct tnode *ch0, struct tnode *ch1
 ) {
-	struct tnode *r = malloc(sizeof(struct tnode));
+	unsigned n = ch0 && ch1 ? 2 : 0;
+	struct tnode *r = malloc(sizeof(struct tnode) + n * sizeof(*r->ch));
 	r->type = type;
-	r->ch[0] = ch0;
-	r->ch[1] = ch1;
+	r->memo = NULL;
+	r->n = n;
+	if (n) {
+		r->ch[0] = ch0;
+		r->ch[1] = ch1;
+	}
+	r->id = n ? MIN(ch0->id, ch1->id) : 0;
 	r->fields = ~(fieldmap_t)0;
 	return r;
 }
@@ -149,7 +233,114 @@ int src_create_set(
 	struct src_array *s, struct fnode_arr list, const struct fnode *formula
 );
 
-struct str_array tnode_eval(const struct tnode *e, const struct str_array *a);
+/* size of the buffer for the error messages of tnode_parse() */
+#define TNODE_ERR_MAX	256
+
+/* Parses the expression s on the inputs up to max_id, literal sets are
+ * appended to sets. Returns NULL and stores a message in err if s cannot be
+ * parsed. */
+struct tnode * tnode_parse(
+	const char *s, char max_id, struct src_array *sets,
+	char err[TNODE_ERR_MAX]
+);
+
+struct pool;
+
+typedef struct str_array tnode_eval_f(
+	const struct tnode *e, const struct str_array *a, struct pool *p
+);
+
+/* evaluates e on the inputs a; independent subtrees are evaluated
+ * concurrently by the threads of p if it is not NULL */
+tnode_eval_f tnode_eval;
+
+/* evaluates e like tnode_eval() but by hashing instead of sorting, so the
+ * order of the result is unspecified */
+tnode_eval_f tnode_eval_hash;
+
+/* Evaluates e like tnode_eval() on dense integer ids of the keys of all
+ * inputs it uses, if all of its nodes select the same fields, including its
+ * common subexpressions. */
+tnode_eval_f tnode_eval_dict;
+
+/* whether all nodes of e select the fields f */
+int tnode_is_uniform_tree(const struct tnode *e, fieldmap_t f);
+
+struct hll;
+
+/* at most this many distinct inputs are supported by tnode_estimate() */
+#define ESTIMATE_MAX_IDS	16
+
+/* Estimates the number of entries of the result of e, which has to select
+ * the same fields in all of its nodes, from HyperLogLog sketches s[id] of
+ * the keys of its inputs. Returns the estimate and stores a bound on its
+ * standard error in *err, or a negative value if e uses more than
+ * ESTIMATE_MAX_IDS distinct inputs. */
+double tnode_estimate(const struct tnode *e, const struct hll *s, double *err);
+
+/* Stores in del and add the entries leaving and entering the result of e,
+ * which has to select the same fields in all of its nodes, when its inputs
+ * change from before to after. Both only need to contain the entries with
+ * the keys changed. Keys represented by another entry now are in both. As
+ * e is evaluated twice, it must not share subexpressions by tnode_share(). */
+void tnode_delta(
+	const struct tnode *e, const struct str_array *before,
+	const struct str_array *after, struct str_array *del,
+	struct str_array *add
+);
+
+/* appends to u the entries of a whose fields f equal those of an entry of
+ * keys; both are sorted and uniq'd wrt. f */
+void str_restrict(
+	struct str_array *u, const struct str_array *a,
+	const struct str_array *keys, fieldmap_t f
+);
+
+/* appends to u the entries of a without those whose fields f equal those of
+ * an entry of del or add, merged with the entries of add; all are sorted and
+ * uniq'd wrt. f */
+void str_apply(
+	struct str_array *u, const struct str_array *a,
+	const struct str_array *del, const struct str_array *add, fieldmap_t f
+);
+
+/* evaluates the common subexpressions of e found by tnode_share() by eval,
+ * which needs to be done before eval(e, a, p) */
+void tnode_eval_shared(
+	const struct tnode *e, const struct str_array *a, struct pool *p,
+	tnode_eval_f *eval
+);
+
+/* stores eval(e->ch[i], a, p) in r[i] for all children; all but the first
+ * are spawned as tasks on p, if given */
+void tnode_eval_children(
+	const struct tnode *e, const struct str_array *a, struct pool *p,
+	tnode_eval_f *eval, struct str_array *r
+);
+
+/* hash of the fields selected by fmap in *s */
+uint64_t str_hash(const struct str *s, fieldmap_t fmap);
+
+/* appends to u the entries of a whose fields selected by fa equal those
+ * selected by fk of some entry of keys */
+void str_semijoin(
+	struct str_array *u, const struct str_array *a, fieldmap_t fa,
+	const struct str_array *keys, fieldmap_t fk
+);
+
+/* compares the fields selected by fmap in *pa to those selected by fmbp in *pb */
+int str_xcmp(
+	const struct str *pa, fieldmap_t fmap,
+	const struct str *pb, fieldmap_t fmbp
+);
+
+/* sorts a wrt. the fields in fmap and removes duplicates, keeping the first
+ * of equal entries, as well as entries not having any of these fields; large
+ * arrays are sorted on p if not NULL */
+void sort_uniq(struct str_array *a, fieldmap_t fmap, struct pool *p);
+
+/* like sort_uniq() for a already sorted wrt. fmap */
+void uniq(struct str_array *a, fieldmap_t fmap);
 
 static inline fieldmap_t tnode_field(int from, int to)
 {
@@ -12,9 +12,9 @@
 #include "tparse.h"
 #include "tlex.h"
 
-static int yyerror(struct tnode **expr, yyscan_t scanner, char max_id, struct src_array *sets, const char *msg)
+static int yyerror(struct tnode **expr, yyscan_t scanner, char max_id, struct src_array *sets, char *err, const char *msg)
 {
-	fprintf(stderr, "error: %s\n", msg);
+	snprintf(err, TNODE_ERR_MAX, "%s", msg);
 	return 0;
 }
 
@@ -42,6 +42,7 @@ typedef void* yyscan_t;
 %parse-param	{ yyscan_t scanner }
 %parse-param	{ char max_id }
 %parse-param	{ struct src_array *sets }
+%parse-param	{ char *err }
 
 %union {
 	struct tnode *tnode;
@@ -70,6 +71,9 @@ typedef void* yyscan_t;
 
 %type <tnode> expr
 
+/* partial trees of failed parses, e.g. of requests in server mode */
+%destructor { tnode_tree_free($$); } <tnode>
+
 %type <ival> field
 %type <ival> field_list
 %type <ival> fields
@@ -110,8 +114,8 @@ expr
 			snprintf(buf, sizeof(buf),
 			         "ID '%c' too large or wrong number of inputs",
 			         $1);
-			yyerror(expr,scanner,max_id,sets,buf);
-			return -1;
+			yyerror(expr,scanner,max_id,sets,err,buf);
+			YYABORT;
 		}
 	}
 	;
@@ -182,18 +186,39 @@ field_list
 field
 	: TOKEN_NUM {
 		if ($1 > MAX_FIELD) {
-			yyerror(expr,scanner,max_id,sets,"field must be between 0 and " XSTR(MAX_FIELD));
-			return -2;
+			yyerror(expr,scanner,max_id,sets,err,"field must be between 0 and " XSTR(MAX_FIELD));
+			YYABORT;
 		}
 		$$ = tnode_field($1, $1);
 	  }
 	| TOKEN_NUM ':' TOKEN_NUM {
 		if ($1 > MAX_FIELD || $3 > MAX_FIELD) {
-			yyerror(expr,scanner,max_id,sets,"field must be between 0 and " XSTR(MAX_FIELD));
-			return -2;
+			yyerror(expr,scanner,max_id,sets,err,"field must be between 0 and " XSTR(MAX_FIELD));
+			YYABORT;
 		}
 		$$ = $1 <= $3 ? tnode_field($1, $3) : tnode_field($3, $1);
 	  }
 	;
 
 %%
+
+struct tnode * tnode_parse(
+	const char *s, char max_id, struct src_array *sets,
+	char err[TNODE_ERR_MAX]
+) {
+	struct tnode *r;
+	yyscan_t scanner;
+	YY_BUFFER_STATE state;
+
+	if (yylex_init(&scanner)) {
+		snprintf(err, TNODE_ERR_MAX, "cannot initialize scanner: %s",
+		         strerror(errno));
+		return NULL;
+	}
+	state = yy_scan_string(s, scanner);
+	if (yyparse(&r, scanner, max_id, sets, err))
+		r = NULL;
+	yy_delete_buffer(state, scanner);
+	yylex_destroy(scanner);
+	return r;
+}